@@ -0,0 +1,462 @@
+#include <pt2/pt2.h>
+#include <pt2/obj_loader.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <random>
+
+namespace
+{
+    struct BenchSettings
+    {
+        std::string model       = "./assets/models/stanford-dragon.obj";
+        std::string output      = "";
+        std::string baseline    = "";
+        std::string image       = "";
+        float       tolerance   = 0.05f;
+        int         threads     = 16;
+        glm::vec3   position    = glm::vec3(-15, 12, 8);
+        glm::vec3   look_at     = glm::vec3(0, 0, 0);
+        float       fov         = 90.f;
+        int         copies      = 1;
+        std::string profile     = "balanced";
+        float       spacing     = 10.f;
+        int         spheres     = 0;
+        bool        discs       = false;
+        float       subdivision = 0.f;
+        std::string tessellated = "";
+        bool        parse       = false;
+    };
+
+    void print_usage()
+    {
+        std::cout << "Usage: PT2_bench [--model <path.obj>] [--width <px>] [--height <px>]\n"
+                     "                 [--spp <n>] [--bounces <n>] [--tiles <n>] [--threads <n>]\n"
+                     "                 [--max-spp <n>] [--adaptive <error>] [--min-spp <n>]\n"
+                     "                 [--seed <n>] [--fov <deg>] [--no-packets]\n"
+                     "                 [--engine <megakernel|wavefront>] [--wavefront-size <n>]\n"
+                     "                 [--no-material-sort] [--no-roulette] [--rr-depth <n>]\n"
+                     "                 [--no-nee]\n"
+                     "                 [--tile-order <scanline|spiral|hilbert>]\n"
+                     "                 [--camera <x> <y> <z> <look x> <look y> <look z>]\n"
+                     "                 [--copies <n>] [--spacing <distance>]\n"
+                     "                 [--spheres <n>] [--discs]\n"
+                     "                 [--subdivide <rate>] [--tessellated <path.obj>]\n"
+                     "                 [--profile <interactive|balanced|final|compact>]\n"
+                     "                 [--output <result.json>] [--image <render.png>]\n"
+                     "                 [--baseline <baseline.json>] [--tolerance <fraction>]\n"
+                     "       PT2_bench --parse [--model <path.obj>] [--threads <n>]\n"
+                     "                 [--output ...] [--baseline ...] [--tolerance ...]"
+                  << std::endl;
+    }
+
+    [[nodiscard]] double seconds_since(std::chrono::steady_clock::time_point start)
+    {
+        const auto now = std::chrono::steady_clock::now();
+        return std::chrono::duration<double>(now - start).count();
+    }
+
+    [[nodiscard]] bool same_mesh(const PT2::Mesh &a, const PT2::Mesh &b)
+    {
+        if (a.materials.size() != b.materials.size()) return false;
+        for (size_t i = 0; i < a.materials.size(); i++)
+            if (a.materials[i].name != b.materials[i].name) return false;
+
+        return a.vertices.size() == b.vertices.size() &&
+               std::memcmp(
+                 a.vertices.data(),
+                 b.vertices.data(),
+                 a.vertices.size() * sizeof(glm::vec3)) == 0 &&
+               a.indices == b.indices && a.quad_indices == b.quad_indices &&
+               a.shape_offsets == b.shape_offsets && a.quad_offsets == b.quad_offsets;
+    }
+
+    // Times tinyobj against the parallel loader on the same file and checks they agree
+    [[nodiscard]] std::optional<std::string>
+      parse_bench(const BenchSettings &bench, bool &identical)
+    {
+        const auto bytes = std::filesystem::file_size(bench.model);
+
+        auto       start          = std::chrono::steady_clock::now();
+        const auto serial         = PT2::parse_obj(bench.model);
+        const auto serial_seconds = seconds_since(start);
+
+        start                       = std::chrono::steady_clock::now();
+        const auto parallel         = PT2::parse_obj_parallel(bench.model, bench.threads);
+        const auto parallel_seconds = seconds_since(start);
+        if (!serial.has_value() || !parallel.has_value()) return {};
+
+        const auto megabytes = bytes / 1e6;
+        identical            = same_mesh(*serial, *parallel);
+
+        auto json = std::stringstream();
+        json << "{\n";
+        json << "  \"model\": \"" << bench.model << "\",\n";
+        json << "  \"bytes\": " << bytes << ",\n";
+        json << "  \"threads\": " << bench.threads << ",\n";
+        json << "  \"triangles\": " << parallel->indices.size() / 3 << ",\n";
+        json << "  \"quads\": " << parallel->quad_indices.size() / 4 << ",\n";
+        json << "  \"tinyobj_ms\": " << serial_seconds * 1000.0 << ",\n";
+        json << "  \"parallel_ms\": " << parallel_seconds * 1000.0 << ",\n";
+        json << "  \"identical\": " << (identical ? "true" : "false") << ",\n";
+        json << "  \"tinyobj_mb_per_second\": " << megabytes / serial_seconds << ",\n";
+        json << "  \"parallel_mb_per_second\": " << megabytes / parallel_seconds << "\n";
+        json << "}";
+        return json.str();
+    }
+
+    // Pulls a numeric value out of a flat JSON object, good enough for files this tool wrote
+    [[nodiscard]] std::optional<double> json_number(const std::string &json, const std::string &key)
+    {
+        const auto key_position = json.find('"' + key + '"');
+        if (key_position == std::string::npos) return {};
+
+        const auto colon = json.find(':', key_position);
+        if (colon == std::string::npos) return {};
+
+        return std::strtod(json.c_str() + colon + 1, nullptr);
+    }
+
+    [[nodiscard]] std::string to_json(
+      const BenchSettings &                  bench,
+      const PT2::RayTracingContext &         settings,
+      const PT2::RenderStats &               stats,
+      const std::optional<PT2::RenderStats> &tessellated,
+      uint32_t                               threads)
+    {
+        const auto trace_seconds = stats.trace_ms / 1000.0;
+
+        auto json = std::stringstream();
+        json << "{\n";
+        json << "  \"model\": \"" << bench.model << "\",\n";
+        json << "  \"width\": " << settings.resolution.x << ",\n";
+        json << "  \"height\": " << settings.resolution.y << ",\n";
+        json << "  \"spp\": " << settings.spp << ",\n";
+        json << "  \"max_spp\": " << settings.max_spp << ",\n";
+        json << "  \"adaptive\": " << (settings.adaptive ? "true" : "false") << ",\n";
+        json << "  \"adaptive_threshold\": " << settings.adaptive_threshold << ",\n";
+        json << "  \"min_spp\": " << settings.min_spp << ",\n";
+        json << "  \"bounces\": " << settings.bounces << ",\n";
+        json << "  \"next_event\": " << (settings.next_event ? "true" : "false") << ",\n";
+        json << "  \"russian_roulette\": " << (settings.russian_roulette ? "true" : "false")
+             << ",\n";
+        json << "  \"rr_min_depth\": " << settings.rr_min_depth << ",\n";
+        json << "  \"tiles\": " << settings.tiles.count << ",\n";
+        json << "  \"triangles\": " << stats.triangles << ",\n";
+        json << "  \"quads\": " << stats.quads << ",\n";
+        json << "  \"points\": " << stats.points << ",\n";
+        json << "  \"instances\": " << stats.instances << ",\n";
+        json << "  \"threads\": " << threads << ",\n";
+        json << "  \"seed\": " << settings.seed << ",\n";
+        json << "  \"engine\": \""
+             << (settings.engine == PT2::RenderEngine::WAVEFRONT ? "wavefront" : "megakernel")
+             << "\",\n";
+        json << "  \"sort_by_material\": " << (settings.sort_by_material ? "true" : "false")
+             << ",\n";
+        json << "  \"tile_order\": \""
+             << (settings.tile_order == PT2::TileOrder::SCANLINE ? "scanline"
+                 : settings.tile_order == PT2::TileOrder::SPIRAL ? "spiral"
+                                                                  : "hilbert")
+             << "\",\n";
+        json << "  \"packet_primary\": " << (settings.packet_primary ? "true" : "false") << ",\n";
+        json << "  \"build_profile\": \"" << bench.profile << "\",\n";
+        json << "  \"load_ms\": " << stats.load_ms << ",\n";
+        json << "  \"build_ms\": " << stats.build_ms << ",\n";
+        json << "  \"bvh_mb\": " << stats.bvh_bytes / 1e6 << ",\n";
+        json << "  \"trace_alloc_mb\": " << stats.trace_bytes / 1e6 << ",\n";
+        json << "  \"subdivision_rate\": " << bench.subdivision << ",\n";
+        if (tessellated.has_value())
+        {
+            const auto seconds = tessellated->trace_ms / 1000.0;
+            json << "  \"tessellated_model\": \"" << bench.tessellated << "\",\n";
+            json << "  \"tessellated_triangles\": " << tessellated->triangles << ",\n";
+            json << "  \"tessellated_quads\": " << tessellated->quads << ",\n";
+            json << "  \"tessellated_build_ms\": " << tessellated->build_ms << ",\n";
+            json << "  \"tessellated_bvh_mb\": " << tessellated->bvh_bytes / 1e6 << ",\n";
+            json << "  \"tessellated_trace_alloc_mb\": " << tessellated->trace_bytes / 1e6
+                 << ",\n";
+            json << "  \"tessellated_mrays_per_second\": " << tessellated->rays / seconds / 1e6
+                 << ",\n";
+        }
+        json << "  \"trace_ms\": " << stats.trace_ms << ",\n";
+        json << "  \"resolve_ms\": " << stats.resolve_ms << ",\n";
+        json << "  \"rays\": " << stats.rays << ",\n";
+        json << "  \"samples\": " << stats.samples << ",\n";
+        json << "  \"steals\": " << stats.steals << ",\n";
+        json << "  \"idle_ms\": " << stats.idle_ms << ",\n";
+        json << "  \"mrays_per_second\": " << stats.rays / trace_seconds / 1e6 << ",\n";
+        json << "  \"samples_per_second\": " << stats.samples / trace_seconds << "\n";
+        json << "}";
+        return json.str();
+    }
+
+    // Returns false if any of the throughput metrics in keys dropped by more than the tolerance
+    [[nodiscard]] bool compare_to_baseline(
+      const std::string &             current,
+      const std::string &             baseline_path,
+      float                           tolerance,
+      const std::vector<std::string> &keys)
+    {
+        auto stream = std::ifstream(baseline_path);
+        if (!stream)
+        {
+            std::cerr << "Failed to open baseline " << baseline_path << std::endl;
+            return false;
+        }
+        const auto baseline = std::string(std::istreambuf_iterator<char>(stream), {});
+
+        auto passed = true;
+        for (const auto &key : keys)
+        {
+            const auto old_value = json_number(baseline, key);
+            const auto new_value = json_number(current, key);
+            if (!old_value.has_value() || !new_value.has_value() || *old_value <= 0.0)
+            {
+                std::cerr << key << ": missing from baseline" << std::endl;
+                passed = false;
+                continue;
+            }
+
+            const auto change     = (*new_value - *old_value) / *old_value;
+            const auto regression = change < -tolerance;
+            std::cerr << key << ": " << *old_value << " -> " << *new_value << " ("
+                      << (change >= 0 ? "+" : "") << change * 100.0 << "%)"
+                      << (regression ? " REGRESSION" : "") << std::endl;
+            passed &= !regression;
+        }
+
+        return passed;
+    }
+}    // namespace
+
+int main(int argc, char **argv)
+{
+    auto bench    = BenchSettings();
+    auto settings = PT2::RayTracingContext();
+    settings.spp  = 16;
+    settings.seed = 1;
+
+    for (auto i = 1; i < argc; i++)
+    {
+        const auto has_values = [&](int count) { return i + count < argc; };
+        if (!std::strcmp(argv[i], "--model") && has_values(1))
+            bench.model = argv[++i];
+        else if (!std::strcmp(argv[i], "--width") && has_values(1))
+            settings.resolution.x = std::atoi(argv[++i]);
+        else if (!std::strcmp(argv[i], "--height") && has_values(1))
+            settings.resolution.y = std::atoi(argv[++i]);
+        else if (!std::strcmp(argv[i], "--spp") && has_values(1))
+            settings.spp = std::atoi(argv[++i]);
+        else if (!std::strcmp(argv[i], "--max-spp") && has_values(1))
+            settings.max_spp = std::atoi(argv[++i]);
+        else if (!std::strcmp(argv[i], "--adaptive") && has_values(1))
+        {
+            settings.adaptive           = true;
+            settings.adaptive_threshold = std::atof(argv[++i]);
+            if (settings.adaptive_threshold <= 0.f)
+            {
+                std::cerr << "--adaptive needs a relative error above 0" << std::endl;
+                return -1;
+            }
+        }
+        else if (!std::strcmp(argv[i], "--min-spp") && has_values(1))
+            settings.min_spp = std::atoi(argv[++i]);
+        else if (!std::strcmp(argv[i], "--bounces") && has_values(1))
+            settings.bounces = std::atoi(argv[++i]);
+        else if (!std::strcmp(argv[i], "--tiles") && has_values(1))
+            settings.tiles.count = std::atoi(argv[++i]);
+        else if (!std::strcmp(argv[i], "--threads") && has_values(1))
+            bench.threads = std::max(1, std::atoi(argv[++i]));
+        else if (!std::strcmp(argv[i], "--seed") && has_values(1))
+            settings.seed = std::strtoul(argv[++i], nullptr, 10);
+        else if (!std::strcmp(argv[i], "--fov") && has_values(1))
+            bench.fov = std::atof(argv[++i]);
+        else if (!std::strcmp(argv[i], "--no-packets"))
+            settings.packet_primary = false;
+        else if (!std::strcmp(argv[i], "--engine") && has_values(1))
+            settings.engine = !std::strcmp(argv[++i], "wavefront") ? PT2::RenderEngine::WAVEFRONT
+                                                                   : PT2::RenderEngine::MEGAKERNEL;
+        else if (!std::strcmp(argv[i], "--wavefront-size") && has_values(1))
+            settings.wavefront_size = std::atoi(argv[++i]);
+        else if (!std::strcmp(argv[i], "--no-material-sort"))
+            settings.sort_by_material = false;
+        else if (!std::strcmp(argv[i], "--no-nee"))
+            settings.next_event = false;
+        else if (!std::strcmp(argv[i], "--no-roulette"))
+            settings.russian_roulette = false;
+        else if (!std::strcmp(argv[i], "--rr-depth") && has_values(1))
+            settings.rr_min_depth = std::atoi(argv[++i]);
+        else if (!std::strcmp(argv[i], "--tile-order") && has_values(1))
+        {
+            const auto *order   = argv[++i];
+            settings.tile_order = !std::strcmp(order, "scanline") ? PT2::TileOrder::SCANLINE
+                                  : !std::strcmp(order, "hilbert") ? PT2::TileOrder::HILBERT
+                                                                   : PT2::TileOrder::SPIRAL;
+        }
+        else if (!std::strcmp(argv[i], "--camera") && has_values(6))
+        {
+            for (auto c = 0; c < 3; c++) bench.position[c] = std::atof(argv[++i]);
+            for (auto c = 0; c < 3; c++) bench.look_at[c] = std::atof(argv[++i]);
+        }
+        else if (!std::strcmp(argv[i], "--profile") && has_values(1))
+            bench.profile = argv[++i];
+        else if (!std::strcmp(argv[i], "--copies") && has_values(1))
+            bench.copies = std::atoi(argv[++i]);
+        else if (!std::strcmp(argv[i], "--spacing") && has_values(1))
+            bench.spacing = std::atof(argv[++i]);
+        else if (!std::strcmp(argv[i], "--spheres") && has_values(1))
+            bench.spheres = std::atoi(argv[++i]);
+        else if (!std::strcmp(argv[i], "--discs"))
+            bench.discs = true;
+        else if (!std::strcmp(argv[i], "--subdivide") && has_values(1))
+            bench.subdivision = std::atof(argv[++i]);
+        else if (!std::strcmp(argv[i], "--tessellated") && has_values(1))
+            bench.tessellated = argv[++i];
+        else if (!std::strcmp(argv[i], "--output") && has_values(1))
+            bench.output = argv[++i];
+        else if (!std::strcmp(argv[i], "--image") && has_values(1))
+            bench.image = argv[++i];
+        else if (!std::strcmp(argv[i], "--baseline") && has_values(1))
+            bench.baseline = argv[++i];
+        else if (!std::strcmp(argv[i], "--tolerance") && has_values(1))
+            bench.tolerance = std::atof(argv[++i]);
+        else if (!std::strcmp(argv[i], "--parse"))
+            bench.parse = true;
+        else
+        {
+            print_usage();
+            return -1;
+        }
+    }
+
+    if (bench.parse)
+    {
+        auto       identical = false;
+        const auto result    = parse_bench(bench, identical);
+        if (!result.has_value()) return 1;
+
+        std::cout << *result << std::endl;
+        if (!bench.output.empty())
+        {
+            auto stream = std::ofstream(bench.output);
+            stream << *result << std::endl;
+        }
+
+        if (!identical)
+        {
+            std::cerr << "Parallel OBJ loader disagrees with tinyobj" << std::endl;
+            return 1;
+        }
+
+        const auto keys = std::vector<std::string> { "parallel_mb_per_second" };
+        if (!bench.baseline.empty() &&
+            !compare_to_baseline(*result, bench.baseline, bench.tolerance, keys))
+            return 1;
+
+        return 0;
+    }
+
+    if (!bench.image.empty() && !PT2::Renderer::supported_image(bench.image))
+    {
+        std::cerr << "Unsupported image format " << bench.image << ", use png, bmp or jpg"
+                  << std::endl;
+        return -1;
+    }
+
+    settings.progressive = false;
+    settings.camera      = PT2::Camera(
+      bench.position,
+      bench.look_at,
+      bench.fov,
+      settings.resolution.x / ((float) settings.resolution.y));
+
+    auto renderer = PT2::Renderer(bench.threads);
+    renderer.set_build_profile(
+      bench.profile == "interactive" ? PT2::BuildProfile::INTERACTIVE
+      : bench.profile == "final"     ? PT2::BuildProfile::FINAL
+      : bench.profile == "compact"   ? PT2::BuildProfile::COMPACT
+                                     : PT2::BuildProfile::BALANCED);
+    renderer.set_subdivision(bench.subdivision);
+
+    const auto build_scene = [&](const std::string &model) {
+        renderer.clear_scene();
+
+        // --model none benches the procedural primitives on their own
+        if (model != "none")
+        {
+            renderer.load_model(model, PT2::ModelType::OBJ);
+
+            // Extra copies on a square grid next to the first, all instancing the same model
+            const auto copies  = static_cast<float>(bench.copies);
+            const auto columns = static_cast<int>(std::ceil(std::sqrt(copies)));
+            for (auto copy = 1; copy < bench.copies; copy++)
+            {
+                auto transform = glm::mat4(1.f);
+                transform[3]   = glm::vec4(
+                  (copy % columns) * bench.spacing,
+                  0.f,
+                  -(copy / columns) * bench.spacing,
+                  1.f);
+                renderer.add_model(model, PT2::ModelType::OBJ, transform);
+            }
+        }
+
+        // Randomly placed in a cube spacing wide around the origin, sized so they don't fill it
+        if (bench.spheres > 0)
+        {
+            auto points                    = PT2::PointSet();
+            points.shape                   = bench.discs ? PT2::PointShape::DISC
+                                                         : PT2::PointShape::SPHERE;
+            points.material.type           = PT2::Material::DIFFUSE;
+            points.material.reflectiveness = 1.f;
+            points.material.color          = glm::vec3(0.8f, 0.8f, 0.8f);
+
+            const auto count  = static_cast<float>(bench.spheres);
+            const auto radius = 0.25f * bench.spacing / std::cbrt(count);
+            auto       random = std::mt19937(settings.seed);
+            auto       offset = std::uniform_real_distribution<float>(-0.5f, 0.5f);
+            points.points.reserve(bench.spheres);
+            for (auto i = 0; i < bench.spheres; i++)
+            {
+                const auto center = glm::vec3(offset(random), offset(random), offset(random));
+                points.points.emplace_back(center * bench.spacing, radius);
+            }
+            renderer.add_points(std::move(points));
+        }
+    };
+
+    build_scene(bench.model);
+    if (!renderer.render_offline(settings, bench.image)) return 1;
+    const auto stats = renderer.stats();
+
+    // The same scene with the pre-tessellated model instead of the subdivided cage
+    auto tessellated = std::optional<PT2::RenderStats>();
+    if (!bench.tessellated.empty())
+    {
+        renderer.set_subdivision(0.f);
+        build_scene(bench.tessellated);
+        if (!renderer.render_offline(settings, "")) return 1;
+        tessellated = renderer.stats();
+    }
+
+    const auto result = to_json(bench, settings, stats, tessellated, renderer.thread_count());
+    std::cout << result << std::endl;
+
+    if (!bench.output.empty())
+    {
+        auto stream = std::ofstream(bench.output);
+        stream << result << std::endl;
+    }
+
+    const auto keys = std::vector<std::string> { "mrays_per_second", "samples_per_second" };
+    if (!bench.baseline.empty() &&
+        !compare_to_baseline(result, bench.baseline, bench.tolerance, keys))
+        return 1;
+
+    return 0;
+}
@@ -1,11 +1,118 @@
 #include <pt2/pt2.h>
 
-int main()
+#include <iostream>
+#include <cstring>
+
+namespace
+{
+    void print_usage()
+    {
+        std::cout << "Usage: PT2 [--model <path.obj>] [--envmap <image>]\n"
+                     "           [--headless <out.png|out.jpg|out.bmp>] [--width <px>] [--height <px>]\n"
+                     "           [--spp <n>] [--max-spp <n>] [--bounces <n>] [--tiles <n>] [--fov <deg>]\n"
+                     "           [--adaptive <relative error>] [--min-spp <n>]\n"
+                     "           [--profile <interactive|balanced|final|compact>]\n"
+                     "           [--subdivide <rate>]\n"
+                     "           [--camera <x> <y> <z> <look x> <look y> <look z>]"
+                  << std::endl;
+    }
+}    // namespace
+
+int main(int argc, char **argv)
 {
+    auto model           = std::string("./assets/models/stanford-dragon.obj");
+    auto envmap          = std::string();
+    auto headless_output = std::string();
+    auto settings        = PT2::RayTracingContext();
+    auto camera_position = glm::vec3(-15, 12, 8);
+    auto camera_look_at  = glm::vec3(0, 0, 0);
+    auto fov             = 90.f;
+    auto profile         = PT2::BuildProfile::BALANCED;
+    auto subdivision     = 0.f;
+
+    for (auto i = 1; i < argc; i++)
+    {
+        const auto has_values = [&](int count) { return i + count < argc; };
+        if (!std::strcmp(argv[i], "--model") && has_values(1))
+            model = argv[++i];
+        else if (!std::strcmp(argv[i], "--envmap") && has_values(1))
+            envmap = argv[++i];
+        else if (!std::strcmp(argv[i], "--headless") && has_values(1))
+            headless_output = argv[++i];
+        else if (!std::strcmp(argv[i], "--width") && has_values(1))
+            settings.resolution.x = std::atoi(argv[++i]);
+        else if (!std::strcmp(argv[i], "--height") && has_values(1))
+            settings.resolution.y = std::atoi(argv[++i]);
+        else if (!std::strcmp(argv[i], "--spp") && has_values(1))
+            settings.spp = std::atoi(argv[++i]);
+        else if (!std::strcmp(argv[i], "--max-spp") && has_values(1))
+            settings.max_spp = std::atoi(argv[++i]);
+        else if (!std::strcmp(argv[i], "--adaptive") && has_values(1))
+        {
+            settings.adaptive           = true;
+            settings.adaptive_threshold = std::atof(argv[++i]);
+            if (settings.adaptive_threshold <= 0.f)
+            {
+                std::cerr << "--adaptive needs a relative error above 0" << std::endl;
+                return -1;
+            }
+        }
+        else if (!std::strcmp(argv[i], "--min-spp") && has_values(1))
+            settings.min_spp = std::atoi(argv[++i]);
+        else if (!std::strcmp(argv[i], "--bounces") && has_values(1))
+            settings.bounces = std::atoi(argv[++i]);
+        else if (!std::strcmp(argv[i], "--tiles") && has_values(1))
+            settings.tiles.count = std::atoi(argv[++i]);
+        else if (!std::strcmp(argv[i], "--fov") && has_values(1))
+            fov = std::atof(argv[++i]);
+        else if (!std::strcmp(argv[i], "--profile") && has_values(1))
+        {
+            const auto *name = argv[++i];
+            profile          = !std::strcmp(name, "interactive") ? PT2::BuildProfile::INTERACTIVE
+                               : !std::strcmp(name, "final")     ? PT2::BuildProfile::FINAL
+                               : !std::strcmp(name, "compact")   ? PT2::BuildProfile::COMPACT
+                                                                 : PT2::BuildProfile::BALANCED;
+        }
+        else if (!std::strcmp(argv[i], "--subdivide") && has_values(1))
+            subdivision = std::atof(argv[++i]);
+        else if (!std::strcmp(argv[i], "--camera") && has_values(6))
+        {
+            for (auto c = 0; c < 3; c++) camera_position[c] = std::atof(argv[++i]);
+            for (auto c = 0; c < 3; c++) camera_look_at[c] = std::atof(argv[++i]);
+        }
+        else
+        {
+            print_usage();
+            return -1;
+        }
+    }
+
+    // Checked before anything is loaded or rendered
+    if (!headless_output.empty() && !PT2::Renderer::supported_image(headless_output))
+    {
+        std::cerr << "Unsupported image format " << headless_output << ", use png, bmp or jpg"
+                  << std::endl;
+        return -1;
+    }
 
     auto renderer = PT2::Renderer();
-    renderer.load_model("./assets/models/stanford-dragon.obj", PT2::ModelType::OBJ);
+    renderer.set_build_profile(profile);
+    renderer.set_subdivision(subdivision);
+    renderer.load_model(model, PT2::ModelType::OBJ);
+    if (!envmap.empty()) renderer.load_envmap(envmap);
+
+    if (headless_output.empty())
+    {
         renderer.start_gui();
+        return 0;
+    }
+
+    settings.camera = PT2::Camera(
+      camera_position,
+      camera_look_at,
+      fov,
+      settings.resolution.x / ((float) settings.resolution.y));
+    if (!renderer.render_offline(settings, headless_output)) return 1;
 
 /*
     //    pt2::load_model("../assets/models/1967-shelby-ford-mustang.obj");
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace PT2
+{
+    // Read only mapping of a whole file, unmapped again when it goes out of scope. data() is null
+    // when the file couldn't be opened or is empty.
+    class MappedFile
+    {
+    public:
+        explicit MappedFile(const std::string &path)
+        {
+            const auto file = open(path.c_str(), O_RDONLY);
+            if (file < 0) return;
+
+            struct stat info = {};
+            if (fstat(file, &info) == 0 && info.st_size > 0)
+            {
+                auto *data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+                if (data != MAP_FAILED)
+                {
+                    _data = static_cast<const uint8_t *>(data);
+                    _size = info.st_size;
+                }
+            }
+            close(file);
+        }
+
+        ~MappedFile()
+        {
+            if (_data != nullptr) munmap(const_cast<uint8_t *>(_data), _size);
+        }
+
+        MappedFile(const MappedFile &) = delete;
+        MappedFile &operator=(const MappedFile &) = delete;
+
+        [[nodiscard]] const uint8_t *data() const noexcept { return _data; }
+
+        [[nodiscard]] size_t size() const noexcept { return _size; }
+
+    private:
+        const uint8_t *_data = nullptr;
+        size_t         _size = 0;
+    };
+}    // namespace PT2
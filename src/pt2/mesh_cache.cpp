@@ -0,0 +1,235 @@
+#include <atomic>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+
+#include "mapped_file.h"
+#include "mesh_cache.h"
+
+namespace
+{
+    constexpr char     cache_magic[4] = { 'P', 'T', '2', 'M' };
+    constexpr uint32_t cache_version  = 3;
+
+    // The header is followed by the source path, the vertices, the triangle and quad indices, the
+    // triangle and quad shape offsets and finally a CacheMaterial plus name for every material,
+    // all packed
+    struct CacheHeader
+    {
+        char     magic[4];
+        uint32_t version;
+        uint64_t source_size;
+        int64_t  source_time;
+        uint64_t path_length;
+        uint64_t vertex_count;
+        uint64_t index_count;
+        uint64_t quad_index_count;
+        uint64_t offset_count;
+        uint64_t quad_offset_count;
+        uint64_t material_count;
+    };
+
+    struct CacheMaterial
+    {
+        uint32_t type;
+        float    reflectiveness;
+        float    roughness;
+        float    emission;
+        float    ior;
+        float    color[3];
+        uint32_t name_length;
+    };
+
+    struct SourceStamp
+    {
+        std::string path;
+        uint64_t    size = 0;
+        int64_t     time = 0;
+    };
+
+    [[nodiscard]] std::optional<SourceStamp> stamp_source(const std::string &source)
+    {
+        auto error = std::error_code();
+        auto stamp = SourceStamp();
+        stamp.path = std::filesystem::absolute(source, error).string();
+        stamp.size = std::filesystem::file_size(source, error);
+        if (error) return {};
+
+        stamp.time = std::filesystem::last_write_time(source, error).time_since_epoch().count();
+        if (error) return {};
+
+        return stamp;
+    }
+
+    [[nodiscard]] std::string cache_path(const std::string &source) { return source + ".pt2cache"; }
+
+    // Bounds checked cursor over the mapping, so a truncated or corrupt cache is just stale
+    struct CacheReader
+    {
+        const uint8_t *data;
+        size_t         size;
+        size_t         offset = 0;
+
+        [[nodiscard]] bool read(void *out, size_t bytes)
+        {
+            if (bytes > size - offset) return false;
+            std::memcpy(out, data + offset, bytes);
+            offset += bytes;
+            return true;
+        }
+
+        template<typename T>
+        [[nodiscard]] bool read_array(std::vector<T> &out, uint64_t count)
+        {
+            if (count > (size - offset) / sizeof(T)) return false;
+            PT2::resize_padded(out, count);
+            return read(out.data(), count * sizeof(T));
+        }
+    };
+
+    // Offsets have to be ascending and stay within count
+    [[nodiscard]] bool valid_offsets(const std::vector<uint32_t> &offsets, uint64_t count)
+    {
+        for (size_t i = 0; i < offsets.size(); i++)
+        {
+            const auto previous = i == 0 ? 0 : offsets[i - 1];
+            if (offsets[i] < previous || offsets[i] > count) return false;
+        }
+        return true;
+    }
+
+    template<typename T>
+    void write_array(std::ofstream &stream, const std::vector<T> &array)
+    {
+        stream.write(reinterpret_cast<const char *>(array.data()), array.size() * sizeof(T));
+    }
+}    // namespace
+
+namespace PT2
+{
+    std::optional<Mesh> read_mesh_cache(const std::string &source)
+    {
+        const auto stamp = stamp_source(source);
+        if (!stamp.has_value()) return {};
+
+        const auto file = MappedFile(cache_path(source));
+        if (file.data() == nullptr) return {};
+
+        auto reader = CacheReader { file.data(), file.size() };
+        auto header = CacheHeader();
+        if (!reader.read(&header, sizeof(header))) return {};
+        if (
+          std::memcmp(header.magic, cache_magic, sizeof(cache_magic)) != 0 ||
+          header.version != cache_version || header.source_size != stamp->size ||
+          header.source_time != stamp->time || header.path_length != stamp->path.size())
+            return {};
+
+        auto path = std::string(header.path_length, '\0');
+        if (!reader.read(path.data(), path.size()) || path != stamp->path) return {};
+
+        auto mesh = Mesh();
+        if (
+          !reader.read_array(mesh.vertices, header.vertex_count) ||
+          !reader.read_array(mesh.indices, header.index_count) ||
+          !reader.read_array(mesh.quad_indices, header.quad_index_count) ||
+          !reader.read_array(mesh.shape_offsets, header.offset_count) ||
+          !reader.read_array(mesh.quad_offsets, header.quad_offset_count))
+            return {};
+
+        for (uint64_t i = 0; i < header.material_count; i++)
+        {
+            auto cached = CacheMaterial();
+            if (!reader.read(&cached, sizeof(cached))) return {};
+
+            auto material           = Material();
+            material.type           = static_cast<Material::Type>(cached.type);
+            material.reflectiveness = cached.reflectiveness;
+            material.roughness      = cached.roughness;
+            material.emission       = cached.emission;
+            material.ior            = cached.ior;
+            material.color          = glm::vec3(cached.color[0], cached.color[1], cached.color[2]);
+            material.name           = std::string(cached.name_length, '\0');
+            if (!reader.read(material.name.data(), material.name.size())) return {};
+
+            mesh.materials.push_back(std::move(material));
+        }
+
+        // Shapes become Embree geometries over ranges of the indices, which have to be in bounds
+        if (mesh.shape_count() != mesh.materials.size()) return {};
+        if (mesh.quad_offsets.size() != mesh.shape_offsets.size()) return {};
+        if (
+          !valid_offsets(mesh.shape_offsets, mesh.indices.size() / 3) ||
+          !valid_offsets(mesh.quad_offsets, mesh.quad_indices.size() / 4))
+            return {};
+
+        return mesh;
+    }
+
+    bool write_mesh_cache(const std::string &source, const Mesh &mesh)
+    {
+        const auto stamp = stamp_source(source);
+        if (!stamp.has_value()) return false;
+
+        auto header              = CacheHeader();
+        header.version           = cache_version;
+        header.source_size       = stamp->size;
+        header.source_time       = stamp->time;
+        header.path_length       = stamp->path.size();
+        header.vertex_count      = mesh.vertices.size();
+        header.index_count       = mesh.indices.size();
+        header.quad_index_count  = mesh.quad_indices.size();
+        header.offset_count      = mesh.shape_offsets.size();
+        header.quad_offset_count = mesh.quad_offsets.size();
+        header.material_count    = mesh.materials.size();
+        std::memcpy(header.magic, cache_magic, sizeof(cache_magic));
+
+        // Written to the side and renamed into place, so a reader never maps a half written file.
+        // The name is unique per process and call, so loads of the same model on other
+        // processes sharing the directory never write into each other's file.
+        static auto writes    = std::atomic<uint64_t>(0);
+        const auto  path      = cache_path(source);
+        const auto  unique    = std::to_string(getpid()) + "-" + std::to_string(writes++);
+        const auto  temporary = path + ".tmp" + unique;
+        auto        written   = false;
+        {
+            auto stream = std::ofstream(temporary, std::ios::binary | std::ios::trunc);
+            if (!stream) return false;
+
+            stream.write(reinterpret_cast<const char *>(&header), sizeof(header));
+            stream.write(stamp->path.data(), stamp->path.size());
+            write_array(stream, mesh.vertices);
+            write_array(stream, mesh.indices);
+            write_array(stream, mesh.quad_indices);
+            write_array(stream, mesh.shape_offsets);
+            write_array(stream, mesh.quad_offsets);
+            for (const auto &material : mesh.materials)
+            {
+                auto cached           = CacheMaterial();
+                cached.type           = material.type;
+                cached.reflectiveness = material.reflectiveness;
+                cached.roughness      = material.roughness;
+                cached.emission       = material.emission;
+                cached.ior            = material.ior;
+                cached.color[0]       = material.color.x;
+                cached.color[1]       = material.color.y;
+                cached.color[2]       = material.color.z;
+                cached.name_length    = material.name.size();
+                stream.write(reinterpret_cast<const char *>(&cached), sizeof(cached));
+                stream.write(material.name.data(), material.name.size());
+            }
+
+            written = static_cast<bool>(stream);
+        }
+
+        auto error = std::error_code();
+        if (written) std::filesystem::rename(temporary, path, error);
+        if (!written || error)
+        {
+            std::cerr << "Failed to write mesh cache " << path << std::endl;
+            std::filesystem::remove(temporary, error);
+            return false;
+        }
+        return true;
+    }
+}    // namespace PT2
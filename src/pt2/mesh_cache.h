@@ -0,0 +1,21 @@
+#pragma once
+
+#include <optional>
+#include <string>
+
+#include <pt2/structs.h>
+
+namespace PT2
+{
+    // Binary copy of a parsed model, stored next to it as <model>.pt2cache. Its header records a
+    // format version and the model's path, size and modification time, a mismatch in any of them
+    // makes the cache stale.
+
+    // Memory maps the cache for source and copies the arrays straight out of it. Returns nothing
+    // when there is no cache or it is stale. The mapping is gone once this returns: Mesh owns its
+    // arrays, which Embree shares and light sampling reads, so the cache isn't handed to Embree.
+    [[nodiscard]] std::optional<Mesh> read_mesh_cache(const std::string &source);
+
+    // Best effort, a cache that can't be written only means the next load parses again
+    bool write_mesh_cache(const std::string &source, const Mesh &mesh);
+}    // namespace PT2
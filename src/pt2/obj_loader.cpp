@@ -0,0 +1,596 @@
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <thread>
+
+#define TINYOBJLOADER_IMPLEMENTATION
+
+#include <tinyobj/tinyobjloader.h>
+
+#include "mapped_file.h"
+#include "obj_loader.h"
+
+namespace
+{
+    // Smaller files aren't worth splitting over more threads
+    constexpr size_t min_chunk_size = 1 << 20;
+
+    // A g or o line, which ends the current shape and names the next one
+    struct ShapeEvent
+    {
+        uint32_t    face;       // Faces in the chunk before the line
+        uint32_t    polygon;    // Faces with at least three vertices in the chunk before the line
+        std::string name;
+    };
+
+    // Everything one chunk of lines produced. Face indices are stored as written, negative ones
+    // can only be resolved once the number of vertices in the chunks before it is known.
+    struct ObjChunk
+    {
+        const char *begin = nullptr;
+        const char *end   = nullptr;
+        bool        valid = true;
+
+        std::vector<glm::vec3>  vertices;
+        std::vector<int>        face_indices;
+        std::vector<uint32_t>   face_offsets = { 0 };    // Into face_indices, one past each face
+        std::vector<uint32_t>   face_bases;              // Chunk vertices before each face
+        std::vector<ShapeEvent> events;
+        uint32_t                polygon_count = 0;
+
+        uint64_t              vertex_offset = 0;
+        std::vector<uint32_t> triangles;                   // Three per triangle
+        std::vector<uint32_t> triangle_offsets = { 0 };    // One past each face's triangles
+        std::vector<uint32_t> quads;                       // Four per quad
+        std::vector<uint32_t> quad_offsets = { 0 };        // One past each face's quads
+    };
+
+    [[nodiscard]] bool is_space(char c) { return c == ' ' || c == '\t'; }
+
+    [[nodiscard]] const char *skip_space(const char *p, const char *end)
+    {
+        while (p < end && is_space(*p)) p++;
+        return p;
+    }
+
+    [[nodiscard]] const char *skip_token(const char *p, const char *end)
+    {
+        while (p < end && !is_space(*p)) p++;
+        return p;
+    }
+
+    // tinyobj's parseReal, bounded by the end of the line instead of a terminating zero
+    [[nodiscard]] float parse_real(const char *&p, const char *end)
+    {
+        p                  = skip_space(p, end);
+        const auto *number = p;
+        p                  = skip_token(p, end);
+
+        auto value = 0.0;
+        if (number < p && (p[-1] == 'e' || p[-1] == 'E'))
+        {
+            // tryParseDouble peeks one past a dangling exponent, which may be past the mapping
+            const auto copy = std::string(number, p);
+            tinyobj::tryParseDouble(copy.data(), copy.data() + copy.size(), &value);
+        }
+        else
+            tinyobj::tryParseDouble(number, p, &value);
+
+        return static_cast<float>(value);
+    }
+
+    // atoi, bounded by the end of the line
+    [[nodiscard]] int parse_int(const char *p, const char *end)
+    {
+        while (p < end && std::isspace(static_cast<unsigned char>(*p))) p++;
+
+        const auto negative = p < end && *p == '-';
+        if (p < end && (*p == '-' || *p == '+')) p++;
+
+        auto value = 0u;
+        for (; p < end && *p >= '0' && *p <= '9'; p++) value = value * 10 + (*p - '0');
+        return static_cast<int>(negative ? 0u - value : value);
+    }
+
+    [[nodiscard]] const char *skip_index(const char *p, const char *end)
+    {
+        while (p < end && *p != '/' && !is_space(*p)) p++;
+        return p;
+    }
+
+    // tinyobj's parseTriple, only the position index is kept. Zero is not a valid index for any
+    // of the three, tinyobj fails the whole file for it.
+    [[nodiscard]] bool parse_triple(const char *&p, const char *end, int &position)
+    {
+        position = parse_int(p, end);
+        if (position == 0) return false;
+
+        p = skip_index(p, end);
+        if (p == end || *p != '/') return true;
+        p++;
+
+        // i//k
+        if (p != end && *p == '/')
+        {
+            p++;
+            if (parse_int(p, end) == 0) return false;
+            p = skip_index(p, end);
+            return true;
+        }
+
+        // i/j or i/j/k
+        if (parse_int(p, end) == 0) return false;
+        p = skip_index(p, end);
+        if (p == end || *p != '/') return true;
+        p++;
+
+        if (parse_int(p, end) == 0) return false;
+        p = skip_index(p, end);
+        return true;
+    }
+
+    void parse_line(ObjChunk &chunk, const char *line, const char *end)
+    {
+        line = skip_space(line, end);
+        if (end - line < 2 || !is_space(line[1])) return;
+
+        if (line[0] == 'v')
+        {
+            auto      *p = line + 2;
+            const auto x = parse_real(p, end);
+            const auto y = parse_real(p, end);
+            const auto z = parse_real(p, end);
+            chunk.vertices.emplace_back(x, y, z);
+        }
+        else if (line[0] == 'f')
+        {
+            for (auto *p = skip_space(line + 2, end); p < end; p = skip_space(p, end))
+            {
+                auto position = 0;
+                if (!parse_triple(p, end, position))
+                {
+                    chunk.valid = false;
+                    return;
+                }
+                chunk.face_indices.push_back(position);
+            }
+            if (chunk.face_indices.size() - chunk.face_offsets.back() >= 3) chunk.polygon_count++;
+            chunk.face_offsets.push_back(chunk.face_indices.size());
+            chunk.face_bases.push_back(chunk.vertices.size());
+        }
+        else if (line[0] == 'g')
+        {
+            // Every name after the g, joined with single spaces
+            auto name = std::string();
+            for (auto *p = skip_space(line + 1, end); p < end; p = skip_space(p, end))
+            {
+                const auto *token = p;
+                p                 = skip_token(p, end);
+                if (!name.empty()) name += ' ';
+                name.append(token, p);
+            }
+            const auto face = static_cast<uint32_t>(chunk.face_bases.size());
+            chunk.events.push_back({ face, chunk.polygon_count, name });
+        }
+        else if (line[0] == 'o')
+        {
+            const auto face = static_cast<uint32_t>(chunk.face_bases.size());
+            chunk.events.push_back({ face, chunk.polygon_count, std::string(line + 2, end) });
+        }
+    }
+
+    void parse_chunk(ObjChunk &chunk)
+    {
+        for (auto *line = chunk.begin; line < chunk.end && chunk.valid;)
+        {
+            // Lines end in \n, \r\n or a lone \r, the same as tinyobj's safeGetline
+            const auto *end  = static_cast<const char *>(std::memchr(line, '\n', chunk.end - line));
+            end              = end == nullptr ? chunk.end : end;
+            const auto *next = end == chunk.end ? chunk.end : end + 1;
+            if (const auto *cr = static_cast<const char *>(std::memchr(line, '\r', end - line)))
+            {
+                next = cr + 1 < chunk.end && cr[1] == '\n' ? cr + 2 : cr + 1;
+                end  = cr;
+            }
+
+            parse_line(chunk, line, end);
+            line = next;
+        }
+    }
+
+    // tinyobj's ear clipping, ported as is so polygons are split into exactly the same triangles
+    void clip_ears(
+      const std::vector<glm::vec3> &vertices,
+      std::vector<int>              polygon,
+      std::vector<uint32_t> &       triangles)
+    {
+        const auto valid = [&](int index) { return static_cast<size_t>(index) < vertices.size(); };
+
+        // Work in the two axes the first proper corner is the least flat in
+        size_t axes[2] = { 1, 2 };
+        for (size_t k = 0; k < polygon.size(); k++)
+        {
+            const auto i0 = polygon[k];
+            const auto i1 = polygon[(k + 1) % polygon.size()];
+            const auto i2 = polygon[(k + 2) % polygon.size()];
+            if (!valid(i0) || !valid(i1) || !valid(i2)) continue;
+
+            const auto e0 = vertices[i1] - vertices[i0];
+            const auto e1 = vertices[i2] - vertices[i1];
+            const auto cx = std::fabs(e0.y * e1.z - e0.z * e1.y);
+            const auto cy = std::fabs(e0.z * e1.x - e0.x * e1.z);
+            const auto cz = std::fabs(e0.x * e1.y - e0.y * e1.x);
+
+            const auto epsilon = std::numeric_limits<float>::epsilon();
+            if (cx > epsilon || cy > epsilon || cz > epsilon)
+            {
+                if (!(cx > cy && cx > cz))
+                {
+                    axes[0] = 0;
+                    if (cz > cx && cz > cy) axes[1] = 1;
+                }
+                break;
+            }
+        }
+
+        auto area = 0.f;
+        for (size_t k = 0; k < polygon.size(); k++)
+        {
+            const auto i0 = polygon[k];
+            const auto i1 = polygon[(k + 1) % polygon.size()];
+            if (!valid(i0) || !valid(i1)) continue;
+
+            const auto &v0 = vertices[i0];
+            const auto &v1 = vertices[i1];
+            area += (v0[axes[0]] * v1[axes[1]] - v0[axes[1]] * v1[axes[0]]) * 0.5f;
+        }
+
+        // Gives up once a full lap around the polygon didn't find an ear
+        auto guess              = size_t(0);
+        auto iterations         = polygon.size();
+        auto previous_remaining = polygon.size();
+        while (polygon.size() > 3 && iterations > 0)
+        {
+            const auto count = polygon.size();
+            if (guess >= count) guess -= count;
+
+            if (previous_remaining != count)
+            {
+                previous_remaining = count;
+                iterations         = count;
+            }
+            else
+                iterations--;
+
+            int   ind[3];
+            float x[3], y[3];
+            for (auto k = 0; k < 3; k++)
+            {
+                ind[k] = polygon[(guess + k) % count];
+                x[k]   = valid(ind[k]) ? vertices[ind[k]][axes[0]] : 0.f;
+                y[k]   = valid(ind[k]) ? vertices[ind[k]][axes[1]] : 0.f;
+            }
+
+            // Reflex corner
+            const auto cross = (x[1] - x[0]) * (y[2] - y[1]) - (y[1] - y[0]) * (x[2] - x[1]);
+            if (cross * area < 0.f)
+            {
+                guess++;
+                continue;
+            }
+
+            auto overlap = false;
+            for (size_t other = 3; other < count && !overlap; other++)
+            {
+                const auto index = polygon[(guess + other) % count];
+                if (!valid(index)) continue;
+
+                const auto &point = vertices[index];
+                overlap           = tinyobj::pnpoly(3, x, y, point[axes[0]], point[axes[1]]);
+            }
+
+            if (overlap)
+            {
+                guess++;
+                continue;
+            }
+
+            triangles.insert(triangles.end(), ind, ind + 3);
+            polygon.erase(polygon.begin() + (guess + 1) % count);
+        }
+
+        if (polygon.size() == 3) triangles.insert(triangles.end(), polygon.begin(), polygon.end());
+    }
+
+    // Triangles and quads are kept as they are, bigger polygons are clipped into triangles and
+    // faces with fewer vertices are skipped. Embree splits a quad along its 1-3 diagonal, which
+    // lies outside a concave quad dented at 0 or 2, so those are rotated to split along 0-2.
+    void add_polygon(
+      const std::vector<glm::vec3> &vertices,
+      const std::vector<int> &      polygon,
+      std::vector<uint32_t> &       triangles,
+      std::vector<uint32_t> &       quads)
+    {
+        const auto valid = [&](int index) { return static_cast<size_t>(index) < vertices.size(); };
+
+        if (polygon.size() == 3)
+            triangles.insert(triangles.end(), polygon.begin(), polygon.end());
+        else if (polygon.size() == 4)
+        {
+            auto rotation = 0;
+            if (std::all_of(polygon.begin(), polygon.end(), valid))
+            {
+                const auto &v0 = vertices[polygon[0]];
+                const auto &v1 = vertices[polygon[1]];
+                const auto &v2 = vertices[polygon[2]];
+                const auto &v3 = vertices[polygon[3]];
+                const auto  n0 = glm::cross(v1 - v0, v3 - v0);
+                const auto  n1 = glm::cross(v3 - v2, v1 - v2);
+                if (glm::dot(n0, n1) < 0.f) rotation = 1;
+            }
+            for (auto k = 0; k < 4; k++) quads.push_back(polygon[(k + rotation) % 4]);
+        }
+        else if (polygon.size() > 4)
+            clip_ears(vertices, polygon, triangles);
+    }
+
+    // Resolves the chunk's face indices against all vertices and splits the faces into triangles
+    // and quads
+    void triangulate_chunk(ObjChunk &chunk, const std::vector<glm::vec3> &vertices)
+    {
+        chunk.triangles.reserve(chunk.face_indices.size());
+        chunk.triangle_offsets.reserve(chunk.face_bases.size() + 1);
+        chunk.quad_offsets.reserve(chunk.face_bases.size() + 1);
+
+        auto polygon = std::vector<int>();
+        for (size_t f = 0; f < chunk.face_bases.size(); f++)
+        {
+            const auto base = static_cast<int>(chunk.vertex_offset + chunk.face_bases[f]);
+
+            polygon.clear();
+            for (auto i = chunk.face_offsets[f]; i < chunk.face_offsets[f + 1]; i++)
+            {
+                const auto index = chunk.face_indices[i];
+                polygon.push_back(index > 0 ? index - 1 : base + index);
+            }
+
+            add_polygon(vertices, polygon, chunk.triangles, chunk.quads);
+            chunk.triangle_offsets.push_back(chunk.triangles.size() / 3);
+            chunk.quad_offsets.push_back(chunk.quads.size() / 4);
+        }
+    }
+
+    // Calls function(i) for every i below count, each on its own thread
+    template<typename Function>
+    void run_parallel(size_t count, const Function &function)
+    {
+        auto threads = std::vector<std::thread>();
+        for (size_t i = 1; i < count; i++) threads.emplace_back(function, i);
+        function(0);
+        for (auto &thread : threads) thread.join();
+    }
+
+    [[nodiscard]] PT2::Material shape_material(const std::string &name)
+    {
+        auto material           = PT2::Material();
+        material.name           = name;
+        material.type           = PT2::Material::DIFFUSE;
+        material.reflectiveness = 1.f;
+        material.color          = glm::vec3(1.f, 1.f, 1.f);
+        return material;
+    }
+}    // namespace
+
+namespace PT2
+{
+    std::optional<Mesh> parse_obj(const std::string &path)
+    {
+        auto mesh = Mesh();
+
+        tinyobj::attrib_t                attrib;
+        std::vector<tinyobj::shape_t>    shapes;
+        std::vector<tinyobj::material_t> materials;
+        std::string                      warn;
+        std::string                      err;
+
+        const auto load = [&](bool triangulate) {
+            attrib = tinyobj::attrib_t();
+            shapes.clear();
+            materials.clear();
+            warn.clear();
+            err.clear();
+            const auto ret = tinyobj::LoadObj(
+              &attrib,
+              &shapes,
+              &materials,
+              &warn,
+              &err,
+              path.c_str(),
+              nullptr,
+              triangulate);
+
+            if (!warn.empty()) std::cout << warn << std::endl;
+            if (!err.empty()) std::cerr << err << std::endl;
+            return ret;
+        };
+
+        // tinyobj counts face vertices in a byte, which bigger faces overflow
+        const auto has_large_faces = [&]() {
+            for (const auto &shape : shapes)
+            {
+                auto index = size_t(0);
+                for (const auto face_vertices : shape.mesh.num_face_vertices)
+                    index += face_vertices;
+                if (index != shape.mesh.indices.size()) return true;
+            }
+            return false;
+        };
+
+        if (!load(false)) return {};
+
+        // Those files are loaded again with tinyobj triangulating every face, like it used to
+        if (has_large_faces())
+        {
+            std::cout << "Faces with more than 255 vertices in " << path
+                      << ", triangulating the whole model" << std::endl;
+            if (!load(true)) return {};
+        }
+
+        if (attrib.vertices.size() % 3 != 0)
+        {
+            std::cerr << "Bad model lol" << std::endl;
+            return {};
+        }
+
+        const auto vertex_count = attrib.vertices.size() / 3;
+        mesh.vertices.reserve(vertex_count);
+        for (auto i = 0; i < attrib.vertices.size(); i += 3)
+        {
+            mesh.vertices.emplace_back(
+              attrib.vertices[i + 0],
+              attrib.vertices[i + 1],
+              attrib.vertices[i + 2]);
+        }
+
+        // Faces are split the same way parse_obj_parallel does it rather than by tinyobj, which
+        // only knows how to triangulate all of them
+        mesh.shape_offsets.push_back(0);
+        mesh.quad_offsets.push_back(0);
+        auto polygon = std::vector<int>();
+        for (const auto &shape : shapes)
+        {
+            auto index = size_t(0);
+            for (const auto face_vertices : shape.mesh.num_face_vertices)
+            {
+                polygon.clear();
+                for (auto v = 0; v < face_vertices; v++)
+                    polygon.push_back(shape.mesh.indices[index++].vertex_index);
+                add_polygon(mesh.vertices, polygon, mesh.indices, mesh.quad_indices);
+            }
+
+            mesh.materials.push_back(shape_material(shape.name));
+            mesh.shape_offsets.push_back(mesh.indices.size() / 3);
+            mesh.quad_offsets.push_back(mesh.quad_indices.size() / 4);
+        }
+
+        return mesh;
+    }
+
+    std::optional<Mesh> parse_obj_parallel(const std::string &path, uint32_t thread_count)
+    {
+        // Empty and unreadable files get tinyobj's handling and messages
+        const auto file = MappedFile(path);
+        if (file.data() == nullptr) return parse_obj(path);
+
+        if (thread_count == 0) thread_count = std::max(1u, std::thread::hardware_concurrency());
+        const auto chunk_count = std::clamp<size_t>(file.size() / min_chunk_size, 1, thread_count);
+
+        // Every chunk but the last ends just after a newline
+        const auto *data   = reinterpret_cast<const char *>(file.data());
+        const auto *end    = data + file.size();
+        auto        chunks = std::vector<ObjChunk>(chunk_count);
+        for (size_t i = 0; i < chunk_count; i++)
+        {
+            chunks[i].begin = i == 0 ? data : chunks[i - 1].end;
+            chunks[i].end   = end;
+            if (i + 1 == chunk_count) break;
+
+            const auto *split = data + file.size() * (i + 1) / chunk_count;
+            split             = std::max(split, chunks[i].begin);
+            if (const auto *newline = std::memchr(split, '\n', end - split))
+                chunks[i].end = static_cast<const char *>(newline) + 1;
+        }
+
+        run_parallel(chunk_count, [&](size_t i) { parse_chunk(chunks[i]); });
+
+        auto mesh         = Mesh();
+        auto vertex_count = uint64_t(0);
+        for (auto &chunk : chunks)
+        {
+            if (!chunk.valid)
+            {
+                std::cerr << "Failed to parse `f' line (e.g. zero value for face index) in " << path
+                          << std::endl;
+                return {};
+            }
+            chunk.vertex_offset = vertex_count;
+            vertex_count += chunk.vertices.size();
+        }
+
+        // Polygons are clipped against the final vertex positions, so those are merged first.
+        // Each chunk's copy is freed as soon as it's merged to keep the peak down.
+        resize_padded(mesh.vertices, vertex_count);
+        run_parallel(chunk_count, [&](size_t i) {
+            auto &chunk = chunks[i];
+            std::copy(
+              chunk.vertices.begin(),
+              chunk.vertices.end(),
+              mesh.vertices.begin() + chunk.vertex_offset);
+            std::vector<glm::vec3>().swap(chunk.vertices);
+        });
+        run_parallel(chunk_count, [&](size_t i) { triangulate_chunk(chunks[i], mesh.vertices); });
+
+        auto triangle_offsets = std::vector<uint64_t>(chunk_count + 1, 0);
+        auto quad_offsets     = std::vector<uint64_t>(chunk_count + 1, 0);
+        for (size_t i = 0; i < chunk_count; i++)
+        {
+            triangle_offsets[i + 1] = triangle_offsets[i] + chunks[i].triangles.size() / 3;
+            quad_offsets[i + 1]     = quad_offsets[i] + chunks[i].quads.size() / 4;
+        }
+
+        resize_padded(mesh.indices, triangle_offsets.back() * 3);
+        resize_padded(mesh.quad_indices, quad_offsets.back() * 4);
+        run_parallel(chunk_count, [&](size_t i) {
+            auto &chunk = chunks[i];
+            std::copy(
+              chunk.triangles.begin(),
+              chunk.triangles.end(),
+              mesh.indices.begin() + triangle_offsets[i] * 3);
+            std::copy(
+              chunk.quads.begin(),
+              chunk.quads.end(),
+              mesh.quad_indices.begin() + quad_offsets[i] * 4);
+            std::vector<uint32_t>().swap(chunk.triangles);
+            std::vector<uint32_t>().swap(chunk.quads);
+        });
+
+        // A g or o line only keeps the shape before it when that one has a face with at least
+        // three vertices, the last shape is kept as soon as it has any face. Dropped shapes have
+        // no triangles or quads, so the kept ones still cover all of them in order.
+        mesh.shape_offsets.push_back(0);
+        mesh.quad_offsets.push_back(0);
+        const auto add_shape = [&](const std::string &name, uint64_t triangle, uint64_t quad) {
+            mesh.materials.push_back(shape_material(name));
+            mesh.shape_offsets.push_back(triangle);
+            mesh.quad_offsets.push_back(quad);
+        };
+
+        auto name          = std::string();
+        auto face_count    = uint64_t(0);
+        auto shape_face    = uint64_t(0);
+        auto polygon_count = uint64_t(0);
+        auto shape_polygon = uint64_t(0);
+        for (size_t i = 0; i < chunk_count; i++)
+        {
+            for (const auto &event : chunks[i].events)
+            {
+                const auto triangle = triangle_offsets[i] + chunks[i].triangle_offsets[event.face];
+                const auto quad     = quad_offsets[i] + chunks[i].quad_offsets[event.face];
+                const auto polygon  = polygon_count + event.polygon;
+                if (polygon > shape_polygon) add_shape(name, triangle, quad);
+
+                name          = event.name;
+                shape_face    = face_count + event.face;
+                shape_polygon = polygon;
+            }
+            face_count += chunks[i].face_bases.size();
+            polygon_count += chunks[i].polygon_count;
+        }
+        if (face_count > shape_face) add_shape(name, triangle_offsets.back(), quad_offsets.back());
+
+        return mesh;
+    }
+}    // namespace PT2
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+
+#include <pt2/structs.h>
+
+namespace PT2
+{
+    // Reads an OBJ with tinyobj, one material per shape. Quads are kept, other polygons are
+    // triangulated.
+    [[nodiscard]] std::optional<Mesh> parse_obj(const std::string &path);
+
+    // Same result as parse_obj, but the file is memory mapped and split into line aligned chunks
+    // that are parsed on thread_count threads (0 picks one per core). Only positions, faces and
+    // g / o shape boundaries are read, which is everything parse_obj keeps.
+    [[nodiscard]] std::optional<Mesh>
+      parse_obj_parallel(const std::string &path, uint32_t thread_count = 0);
+}    // namespace PT2
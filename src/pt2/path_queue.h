@@ -0,0 +1,128 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include <embree3/rtcore.h>
+#include <glm/glm.hpp>
+
+#include <pt2/structs.h>
+
+namespace PT2
+{
+    // Structure of arrays state for a batch of in-flight paths. The ray / hit arrays are laid out
+    // the way rtcIntersectNp expects them, so a whole batch is traced with a single call.
+    struct PathQueue
+    {
+    public:
+        void reserve(uint32_t count)
+        {
+            if (count <= capacity) return;
+            capacity = count;
+
+            for (auto *array : { &org_x, &org_y, &org_z, &tnear, &dir_x, &dir_y, &dir_z, &time })
+                array->resize(count);
+            for (auto *array : { &tfar, &ng_x, &ng_y, &ng_z, &u, &v, &scatter_pdf })
+                array->resize(count);
+            for (auto *array : { &mask, &id, &flags, &prim_id, &geom_id, &inst_id, &pixel })
+                array->resize(count);
+            throughput.resize(count);
+            radiance.resize(count);
+        }
+
+        void push(const Ray &ray, uint32_t pixel_index)
+        {
+            const auto i  = size++;
+            id[i]          = i;
+            pixel[i]       = pixel_index;
+            throughput[i]  = glm::vec3(1, 1, 1);
+            radiance[i]    = glm::vec3(0, 0, 0);
+            scatter_pdf[i] = 0.f;
+            set_ray(i, ray);
+        }
+
+        // Stores a new ray for path i and resets its hit so it can be traced again
+        void set_ray(uint32_t i, const Ray &ray)
+        {
+            org_x[i]   = ray.origin.x;
+            org_y[i]   = ray.origin.y;
+            org_z[i]   = ray.origin.z;
+            dir_x[i]   = ray.direction.x;
+            dir_y[i]   = ray.direction.y;
+            dir_z[i]   = ray.direction.z;
+            tnear[i]   = 0.f;
+            tfar[i]    = std::numeric_limits<float>::infinity();
+            time[i]    = 0.f;
+            mask[i]    = -1;
+            flags[i]   = 0;
+            geom_id[i] = RTC_INVALID_GEOMETRY_ID;
+            inst_id[i] = RTC_INVALID_GEOMETRY_ID;
+        }
+
+        [[nodiscard]] Ray ray(uint32_t i) const
+        {
+            return Ray(
+              glm::vec3(org_x[i], org_y[i], org_z[i]),
+              glm::vec3(dir_x[i], dir_y[i], dir_z[i]));
+        }
+
+        [[nodiscard]] bool hit(uint32_t i) const { return geom_id[i] != RTC_INVALID_GEOMETRY_ID; }
+
+        // Copies everything about path `from` into slot `to`, used to compact the queue
+        void move(uint32_t from, uint32_t to)
+        {
+            for (auto *array : { &org_x, &org_y, &org_z, &tnear, &dir_x, &dir_y, &dir_z, &time })
+                (*array)[to] = (*array)[from];
+            for (auto *array : { &tfar, &ng_x, &ng_y, &ng_z, &u, &v, &scatter_pdf })
+                (*array)[to] = (*array)[from];
+            for (auto *array : { &mask, &flags, &prim_id, &geom_id, &inst_id, &pixel })
+                (*array)[to] = (*array)[from];
+            throughput[to] = throughput[from];
+            radiance[to]   = radiance[from];
+        }
+
+        [[nodiscard]] RTCRayHitNp ray_hit()
+        {
+            auto ray_hit          = RTCRayHitNp();
+            ray_hit.ray.org_x     = org_x.data();
+            ray_hit.ray.org_y     = org_y.data();
+            ray_hit.ray.org_z     = org_z.data();
+            ray_hit.ray.tnear     = tnear.data();
+            ray_hit.ray.dir_x     = dir_x.data();
+            ray_hit.ray.dir_y     = dir_y.data();
+            ray_hit.ray.dir_z     = dir_z.data();
+            ray_hit.ray.time      = time.data();
+            ray_hit.ray.tfar      = tfar.data();
+            ray_hit.ray.mask      = mask.data();
+            ray_hit.ray.id        = id.data();
+            ray_hit.ray.flags     = flags.data();
+            ray_hit.hit.Ng_x      = ng_x.data();
+            ray_hit.hit.Ng_y      = ng_y.data();
+            ray_hit.hit.Ng_z      = ng_z.data();
+            ray_hit.hit.u         = u.data();
+            ray_hit.hit.v         = v.data();
+            ray_hit.hit.primID    = prim_id.data();
+            ray_hit.hit.geomID    = geom_id.data();
+            ray_hit.hit.instID[0] = inst_id.data();
+            return ray_hit;
+        }
+
+        uint32_t size     = 0;
+        uint32_t capacity = 0;
+
+        // Ray
+        std::vector<float>    org_x, org_y, org_z, tnear, dir_x, dir_y, dir_z, time, tfar;
+        std::vector<uint32_t> mask, id, flags;
+
+        // Hit
+        std::vector<float>    ng_x, ng_y, ng_z, u, v;
+        std::vector<uint32_t> prim_id, geom_id, inst_id;
+
+        // Path
+        std::vector<glm::vec3> throughput;
+        std::vector<glm::vec3> radiance;
+        std::vector<float>     scatter_pdf;    // See Renderer::_shade_hit
+        std::vector<uint32_t>  pixel;
+    };
+}    // namespace PT2
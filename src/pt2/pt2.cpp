@@ -4,7 +4,9 @@
 #include <memory>
 #include <queue>
 #include <chrono>
+#include <fstream>
 #include <iostream>
+#include <algorithm>
 #include <unordered_map>
 
 #define STB_IMAGE_IMPLEMENTATION
@@ -15,10 +17,6 @@
 
 #include <stb/stb_write.h>
 
-#define TINYOBJLOADER_IMPLEMENTATION
-
-#include <tinyobj/tinyobjloader.h>
-
 #include <embree3/rtcore.h>
 
 #include <imgui.h>
@@ -27,20 +25,87 @@
 
 #include <pt2/imgui_custom.h>
 #include <pt2/sampling.h>
+#include <pt2/mesh_cache.h>
+#include <pt2/obj_loader.h>
 
 namespace
 {
+    thread_local std::mt19937 generator;
+
     [[nodiscard]] float rand_float()
     {
-        thread_local static std::mt19937                          gen;
         thread_local static std::uniform_real_distribution<float> dist(0.f, 1.f);
-        return dist(gen);
+        return dist(generator);
+    }
+
+    // Reseeds the calling thread so a tile's samples don't depend on which worker picked it up
+    void seed_rand(uint32_t seed, uint32_t x, uint32_t y, uint32_t pass)
+    {
+        auto sequence = std::seed_seq { seed, x, y, pass };
+        generator.seed(sequence);
+    }
+
+    // Maps a distance along a Hilbert curve filling an n * n grid (n a power of two) to x / y
+    void hilbert_d2xy(uint32_t n, uint32_t d, uint32_t &x, uint32_t &y)
+    {
+        x = y = 0;
+        for (auto s = 1u; s < n; s *= 2)
+        {
+            const auto rx = 1 & (d / 2);
+            const auto ry = 1 & (d ^ rx);
+            if (ry == 0)
+            {
+                if (rx == 1)
+                {
+                    x = s - 1 - x;
+                    y = s - 1 - y;
+                }
+                std::swap(x, y);
+            }
+            x += s * rx;
+            y += s * ry;
+            d /= 4;
+        }
+    }
+
+    struct BuildSettings
+    {
+        RTCBuildQuality quality;
+        RTCSceneFlags   flags;
+    };
+
+    [[nodiscard]] BuildSettings build_settings(PT2::BuildProfile profile)
+    {
+        switch (profile)
+        {
+        case PT2::BuildProfile::INTERACTIVE:
+            return { RTC_BUILD_QUALITY_LOW, RTC_SCENE_FLAG_DYNAMIC };
+        case PT2::BuildProfile::FINAL:
+            return { RTC_BUILD_QUALITY_HIGH, RTC_SCENE_FLAG_NONE };
+        case PT2::BuildProfile::COMPACT:
+            return { RTC_BUILD_QUALITY_MEDIUM, RTC_SCENE_FLAG_COMPACT };
+        default:
+            return { RTC_BUILD_QUALITY_MEDIUM, RTC_SCENE_FLAG_NONE };
+        }
+    }
+
+    // Embree's memory monitor, bytes is negative for frees
+    bool track_device_memory(void *counter, ssize_t bytes, bool)
+    {
+        *static_cast<std::atomic<int64_t> *>(counter) += bytes;
+        return true;
+    }
+
+    [[nodiscard]] double milliseconds_since(std::chrono::steady_clock::time_point start)
+    {
+        const auto now = std::chrono::steady_clock::now();
+        return std::chrono::duration<double, std::milli>(now - start).count();
     }
 }    // namespace
 
 namespace PT2
 {
-    Renderer::Renderer() : _render_pool(16) { _initialize(); }
+    Renderer::Renderer(uint32_t thread_count) : _render_pool(thread_count) { _initialize(); }
 
     Renderer::~Renderer() = default;
 
@@ -48,12 +113,29 @@ namespace PT2
 
     void Renderer::_initialize()
     {
-        _device   = rtcNewDevice(nullptr);
-        _scene    = rtcNewScene(_device);
-        _geometry = rtcNewGeometry(_device, RTC_GEOMETRY_TYPE_TRIANGLE);
-        rtcCommitGeometry(_geometry);
-        rtcAttachGeometry(_scene, _geometry);
+        _device = rtcNewDevice(nullptr);
+        rtcSetDeviceMemoryMonitorFunction(_device, track_device_memory, &_device_bytes);
+
+        // Only trace primary ray packets when this CPU has a native code path for them
+        if (rtcGetDeviceProperty(_device, RTC_DEVICE_PROPERTY_NATIVE_RAY16_SUPPORTED))
+            _packet_width = 16;
+        else if (rtcGetDeviceProperty(_device, RTC_DEVICE_PROPERTY_NATIVE_RAY8_SUPPORTED))
+            _packet_width = 8;
+        else
+            _packet_width = 1;
+
+        _scene = _new_scene();
         rtcCommitScene(_scene);
+        _scene_bytes_base = _device_bytes;
+    }
+
+    RTCScene Renderer::_new_scene() const
+    {
+        const auto settings = build_settings(_build_profile);
+        auto *     scene    = rtcNewScene(_device);
+        rtcSetSceneBuildQuality(scene, settings.quality);
+        rtcSetSceneFlags(scene, settings.flags);
+        return scene;
     }
 
     void Renderer::_read_file(const std::string &path, std::string &contents)
@@ -183,8 +265,7 @@ namespace PT2
         _rendering_context.resolution_y       = mode->height;
 
         // Setup the texture for displaying the result of the ray tracing buffer
-        _ray_tracing_context.buffer.reserve(
-          _ray_tracing_context.resolution.x * _ray_tracing_context.resolution.y * 3);
+        _reset_accumulation();
 
         GLuint texture = 0;
 
@@ -323,20 +404,16 @@ namespace PT2
                     ImGui::EndCombo();
                 }
 
-                if (ImGui::Button("Load Background") && selectedImage != std::filesystem::path())
+                // Decoding and building the sampling CDF can take seconds for large maps, so that
+                // runs in the background and _poll_envmap swaps the result in once it's ready
+                const auto load = !_pending_envmap.valid() && ImGui::Button("Load Background");
+                if (_pending_envmap.valid()) ImGui::Text("Loading...");
+                if (load && selectedImage != std::filesystem::path())
                 {
-                    int   width, height, components;
-                    auto *data = stbi_load(selectedImage.c_str(), &width, &height, &components, 3);
-                    _envmap    = Image();
-                    _envmap->data = std::vector<uint8_t>();
-                    _envmap->data.resize(width * height * 3, 0);
-                    std::memcpy(_envmap->data.data(), data, width * height * 3);
-                    _envmap->width  = width;
-                    _envmap->height = height;
-                    stbi_image_free(data);
-                    _render_pool.stop();
-                    _render_pool.start();
-                    _render_screen();
+                    _pending_envmap = std::async(
+                      std::launch::async,
+                      &Renderer::_load_envmap_data,
+                      selectedImage.string());
                 }
                 ImGui::End();
             }
@@ -360,12 +437,38 @@ namespace PT2
                     ImGui::EndCombo();
                 }
 
-                if (ImGui::Button("Add Model") && selectedModel != std::filesystem::path())
+                static auto position = glm::vec3(0, 0, 0);
+                ImGui::InputFloat3("Position", &position[0]);
+
+                // A model that isn't in the scene yet is parsed and built in the background, the
+                // scene keeps rendering until _poll_model places it. Further copies only need an
+                // instance, which is cheap enough to add right away.
+                const auto load = !_pending_model.valid() && ImGui::Button("Add Model");
+                if (_pending_model.valid()) ImGui::Text("Loading...");
+                if (load && selectedModel != std::filesystem::path())
                 {
-                    _render_pool.stop();
-                    load_model(selectedModel, ModelType::OBJ);
-                    _render_pool.start();
-                    _render_screen();
+                    auto transform = glm::mat4(1.f);
+                    transform[3]   = glm::vec4(position, 1.f);
+
+                    const auto model = _find_model(selectedModel.string());
+                    if (model.has_value())
+                    {
+                        _render_pool.clear_tasks();
+                        _render_pool.wait();
+                        _add_instance(*model, transform);
+                        _reset_accumulation();
+                        _render_screen();
+                    }
+                    else
+                    {
+                        _pending_transform = transform;
+                        _pending_model     = std::async(
+                          std::launch::async,
+                          &Renderer::_load_model_data,
+                          this,
+                          selectedModel.string(),
+                          ModelType::OBJ);
+                    }
                 }
                 ImGui::End();
             }
@@ -378,12 +481,59 @@ namespace PT2
 
                 ImGui::Begin("Rendering Context");
                 ImGui::InputInt("Max Bounces", &ctx.bounces, 1, 5);
-                ImGui::InputInt("Samples Per Pixel", &ctx.spp, 1, 2);
+                ImGui::Checkbox("Sample Lights", &ctx.next_event);
+                ImGui::SameLine();
+                ImGui::Text("(%zu emissive triangles)", _light_triangles.size());
+                ImGui::Checkbox("Russian Roulette", &ctx.russian_roulette);
+                if (ctx.russian_roulette)
+                    ImGui::InputInt("Roulette Min Depth", &ctx.rr_min_depth, 1, 2);
+                ImGui::InputInt("Samples Per Pass", &ctx.spp, 1, 2);
+                ImGui::Checkbox("Progressive", &ctx.progressive);
+                ImGui::InputInt("Max Samples", &ctx.max_spp, 16, 128);
+                ImGui::Checkbox("Adaptive Sampling", &ctx.adaptive);
+                if (ctx.adaptive)
+                {
+                    ImGui::InputInt("Min Samples", &ctx.min_spp, 4, 16);
+                    ImGui::SliderFloat("Error Threshold", &ctx.adaptive_threshold, 0.001f, 0.1f);
+                }
+                if (ImGui::BeginCombo(
+                      "Engine",
+                      ctx.engine == RenderEngine::WAVEFRONT ? "Wavefront" : "Megakernel"))
+                {
+                    if (ImGui::Selectable("Megakernel")) ctx.engine = RenderEngine::MEGAKERNEL;
+                    if (ImGui::Selectable("Wavefront")) ctx.engine = RenderEngine::WAVEFRONT;
+                    ImGui::EndCombo();
+                }
+                if (ctx.engine == RenderEngine::MEGAKERNEL)
+                    ImGui::Checkbox("Packet Primary Rays", &ctx.packet_primary);
+                else
+                {
+                    ImGui::InputInt("Wavefront Size", &ctx.wavefront_size, 1024, 8192);
+                    ImGui::Checkbox("Sort Hits By Material", &ctx.sort_by_material);
+                }
+                ImGui::Text(
+                  "Accumulated Samples: %u%s",
+                  _accumulated_spp,
+                  _render_pool.idle() && _converged() ? " (converged)" : "");
+                const auto pool_stats = _render_pool.stats();
+                ImGui::Text(
+                  "Pool: %lu tasks, %lu steals, %.1f ms idle",
+                  pool_stats.tasks,
+                  pool_stats.steals,
+                  pool_stats.idle_ms);
                 ImGui::InputInt("Res X", &ctx.resolution.x, 2, 10);
                 ImGui::InputInt("Res Y", &ctx.resolution.y, 2, 10);
                 if (ctx.resolution.x % 2 != 0) ctx.resolution.x--;
                 if (ctx.resolution.y % 2 != 0) ctx.resolution.y--;
                 ImGui::SliderInt("Tile Count", &ctx.tiles.count, 4, 32);
+                const char *tile_orders[] = { "Scanline", "Spiral", "Hilbert" };
+                if (ImGui::BeginCombo("Tile Order", tile_orders[(int) ctx.tile_order]))
+                {
+                    if (ImGui::Selectable("Scanline")) ctx.tile_order = TileOrder::SCANLINE;
+                    if (ImGui::Selectable("Spiral")) ctx.tile_order = TileOrder::SPIRAL;
+                    if (ImGui::Selectable("Hilbert")) ctx.tile_order = TileOrder::HILBERT;
+                    ImGui::EndCombo();
+                }
                 ImGui::InputFloat3("Position", &camera_position[0]);
                 ImGui::InputFloat3("Look At", &camera_look_at[0]);
                 ImGui::SliderFloat("FOV", &fov, 30, 120);
@@ -411,8 +561,9 @@ namespace PT2
                       camera_look_at,
                       fov,
                       ctx.resolution.x / ((float) ctx.resolution.y));
-                    ctx.buffer.resize(ctx.resolution.x * ctx.resolution.y * 3, 0);
                     _ray_tracing_context = ctx;
+                    _build_light_list();    // Material emission may have been edited
+                    _reset_accumulation();
                     _render_pool.start();
                     _render_screen();
                 }
@@ -446,19 +597,28 @@ namespace PT2
                         export_file_name_string = file_name;
                     }
 
+                    _export_image(export_file_name_string);
+                }
+            }
 
-                    stbi_flip_vertically_on_write(true);
+            _poll_envmap();
+            _poll_model();
 
-                    stbi_write_jpg(
-                      export_file_name_string.c_str(),
-                      _ray_tracing_context.resolution.x,
-                      _ray_tracing_context.resolution.y,
-                      4,
-                      _ray_tracing_context.buffer.data(),
-                      100);
-                }
+            // Tiles write the accumulation buffers while a pass runs, so they're only resolved
+            // once it's done, and only when a pass finished since the last time
+            if (_render_pool.idle() && _passes_resolved != _passes_started)
+            {
+                _resolve_buffer();
+                _passes_resolved = _passes_started;
             }
 
+            // Keep refining the image one pass at a time while the pool has nothing left to do
+            const auto &ctx     = _ray_tracing_context;
+            const auto  max_spp = _spp_limit();
+            if (ctx.progressive && (max_spp == 0 || _accumulated_spp < max_spp) &&
+                _render_pool.idle() && !_converged())
+                _render_screen();
+
             glUseProgram(program);
             glClearColor(0.7, 0.7, 0.7, 1.0f);
             glClear(GL_COLOR_BUFFER_BIT);
@@ -511,6 +671,54 @@ namespace PT2
         }
     }
 
+    bool Renderer::supported_image(const std::string &path)
+    {
+        const auto extension = std::filesystem::path(path).extension();
+        return extension.empty() || extension == ".png" || extension == ".bmp" ||
+               extension == ".jpg" || extension == ".jpeg";
+    }
+
+    bool Renderer::_export_image(const std::string &path) const
+    {
+        const auto extension = std::filesystem::path(path).extension();
+
+        stbi_flip_vertically_on_write(true);
+
+        auto written = 0;
+        if (extension == ".png")
+            written = stbi_write_png(
+              path.c_str(),
+              _ray_tracing_context.resolution.x,
+              _ray_tracing_context.resolution.y,
+              4,
+              _ray_tracing_context.buffer.data(),
+              _ray_tracing_context.resolution.x * 4);
+        else if (extension == ".bmp")
+            written = stbi_write_bmp(
+              path.c_str(),
+              _ray_tracing_context.resolution.x,
+              _ray_tracing_context.resolution.y,
+              4,
+              _ray_tracing_context.buffer.data());
+        else if (extension.empty() || extension == ".jpg" || extension == ".jpeg")
+            written = stbi_write_jpg(
+              path.c_str(),
+              _ray_tracing_context.resolution.x,
+              _ray_tracing_context.resolution.y,
+              4,
+              _ray_tracing_context.buffer.data(),
+              100);
+        else
+        {
+            std::cerr << "Unsupported image format " << path << ", use png, bmp or jpg"
+                      << std::endl;
+            return false;
+        }
+
+        if (written == 0) std::cerr << "Failed to write image " << path << std::endl;
+        return written != 0;
+    }
+
     void Renderer::_update_uniforms() const
     {
         glUniform1f(
@@ -531,126 +739,608 @@ namespace PT2
 
     void Renderer::load_model(const std::string &model, ModelType model_type)
     {
+        clear_scene();
+        if (!add_model(model, model_type).has_value()) exit(-1);
+    }
+
+    std::optional<uint32_t> Renderer::add_model(
+      const std::string &model,
+      ModelType          model_type,
+      const glm::mat4 &  transform)
+    {
+        auto index = _find_model(model);
+        if (!index.has_value())
+        {
+            auto loaded = _load_model_data(model, model_type);
+            if (!loaded.has_value()) return {};
+            index = _add_model(std::move(*loaded));
+        }
+
+        return _add_instance(*index, transform);
+    }
+
+    uint32_t Renderer::add_points(PointSet points, const glm::mat4 &transform)
+    {
+        const auto build_start = std::chrono::steady_clock::now();
+
+        // A model with one empty shape for the material, so instancing, material lookup and hit
+        // records all work the same as for meshes. Embree reports the sphere's or disc's normal
+        // as the geometry normal.
+        auto loaded               = LoadedModel();
+        loaded.points             = std::move(points.points);
+        loaded.mesh.shape_offsets = { 0, 0 };
+        loaded.mesh.quad_offsets  = { 0, 0 };
+        loaded.mesh.materials.push_back(std::move(points.material));
+
+        loaded.scene = _new_scene();
+        if (!loaded.points.empty())
+        {
+            auto *geometry = rtcNewGeometry(
+              _device,
+              points.shape == PointShape::DISC ? RTC_GEOMETRY_TYPE_DISC_POINT
+                                               : RTC_GEOMETRY_TYPE_SPHERE_POINT);
+            rtcSetGeometryBuildQuality(geometry, build_settings(_build_profile).quality);
+            rtcSetSharedGeometryBuffer(
+              geometry,
+              RTC_BUFFER_TYPE_VERTEX,
+              0,
+              RTC_FORMAT_FLOAT4,
+              loaded.points.data(),
+              0,
+              sizeof(glm::vec4),
+              loaded.points.size());
+            rtcCommitGeometry(geometry);
+            rtcAttachGeometryByID(loaded.scene, geometry, 0);
+            rtcReleaseGeometry(geometry);
+            loaded.geometry_materials.push_back(0);
+        }
+        rtcCommitScene(loaded.scene);
+        loaded.build_ms = milliseconds_since(build_start);
+
+        return _add_instance(_add_model(std::move(loaded)), transform);
+    }
+
+    void Renderer::clear_scene()
+    {
+        if (_scene != nullptr) rtcReleaseScene(_scene);
+        _scene = _new_scene();
+        rtcCommitScene(_scene);
+        _scene_dirty = false;
+
+        for (auto &model : _models) rtcReleaseScene(model.scene);
+        _models.clear();
+        _instances.clear();
         _loaded_materials.clear();
-        _material_indices.clear();
-        _vertices.clear();
-        _indices.clear();
-        if (model_type == ModelType::OBJ)
+
+        // Whatever earlier scenes or renders left allocated isn't counted as this scene's
+        _scene_bytes_base = _device_bytes;
+
+        _selected_material = nullptr;
+        _stats.load_ms     = 0.0;
+        _stats.build_ms    = 0.0;
+        _stats.triangles   = 0;
+        _stats.quads       = 0;
+        _stats.points      = 0;
+        _stats.instances   = 0;
+        _stats.bvh_bytes   = 0;
+        _build_light_list();
+    }
+
+    void Renderer::_poll_model()
+    {
+        if (!_pending_model.valid()) return;
+        if (_pending_model.wait_for(std::chrono::seconds(0)) != std::future_status::ready) return;
+
+        auto loaded = _pending_model.get();
+        if (!loaded.has_value()) return;
+
+        // Same as an envmap swap, the scene stays in use until the running tiles are done
+        _render_pool.clear_tasks();
+        _render_pool.wait();
+        _add_instance(_add_model(std::move(*loaded)), _pending_transform);
+        _reset_accumulation();
+        _render_screen();
+    }
+
+    std::optional<uint32_t> Renderer::_find_model(const std::string &model) const
+    {
+        for (uint32_t i = 0; i < _models.size(); i++)
+            if (_models[i].path == model) return i;
+        return {};
+    }
+
+    uint32_t Renderer::_add_model(LoadedModel &&loaded)
+    {
+        // Growing the material list moves it, so nothing may keep pointing into it
+        loaded.material_offset = _loaded_materials.size();
+        for (auto &material : loaded.mesh.materials)
+            _loaded_materials.push_back(std::move(material));
+        loaded.mesh.materials.clear();
+        _selected_material = nullptr;
+
+        _stats.load_ms += loaded.load_ms;
+        _stats.build_ms += loaded.build_ms;
+        _stats.triangles += loaded.mesh.indices.size() / 3;
+        _stats.quads += loaded.mesh.quad_indices.size() / 4;
+        _stats.points += loaded.points.size();
+        _models.push_back(std::move(loaded));
+        return _models.size() - 1;
+    }
+
+    uint32_t Renderer::_add_instance(uint32_t model, const glm::mat4 &transform)
+    {
+        const auto build_start = std::chrono::steady_clock::now();
+
+        auto instance             = Instance();
+        instance.model            = model;
+        instance.transform        = transform;
+        instance.normal_transform = glm::transpose(glm::inverse(glm::mat3(transform)));
+
+        // Only the instance is added to the top level scene, so rebuilding it stays cheap no
+        // matter how many triangles the model has. The commit waits for the next render, so
+        // placing many copies at once only rebuilds the scene and the light list once.
+        const auto id       = static_cast<uint32_t>(_instances.size());
+        auto *     geometry = rtcNewGeometry(_device, RTC_GEOMETRY_TYPE_INSTANCE);
+        rtcSetGeometryInstancedScene(geometry, _models[model].scene);
+        rtcSetGeometryTransform(geometry, 0, RTC_FORMAT_FLOAT4X4_COLUMN_MAJOR, &transform[0][0]);
+        rtcCommitGeometry(geometry);
+        rtcAttachGeometryByID(_scene, geometry, id);
+        rtcReleaseGeometry(geometry);
+        _instances.push_back(instance);
+        _scene_dirty = true;
+
+        _stats.build_ms += milliseconds_since(build_start);
+        _stats.instances++;
+        return id;
+    }
+
+    void Renderer::_commit_scene()
+    {
+        if (!_scene_dirty) return;
+
+        const auto build_start = std::chrono::steady_clock::now();
+        rtcCommitScene(_scene);
+        _scene_dirty = false;
+
+        _stats.build_ms += milliseconds_since(build_start);
+        _stats.bvh_bytes = _device_bytes - _scene_bytes_base;
+        _build_light_list();
+    }
+
+    std::optional<Renderer::LoadedModel>
+      Renderer::_load_model_data(const std::string &model, ModelType model_type) const
+    {
+        const auto load_start = std::chrono::steady_clock::now();
+        auto       loaded     = LoadedModel();
+        loaded.path           = model;
+
+        // Text parsing dominates loading big models, so it only happens when the binary cache
+        // next to the model is missing or out of date
+        auto mesh = read_mesh_cache(model);
+        if (!mesh.has_value() && model_type == ModelType::OBJ)
+        {
+            mesh = parse_obj_parallel(model, _render_pool.thread_count());
+            if (mesh.has_value()) write_mesh_cache(model, *mesh);
+        }
+        if (!mesh.has_value()) return {};
+        loaded.mesh = std::move(*mesh);
+
+        // Loaders that didn't pad the arrays pay for one reallocation here
+        auto &vertices = loaded.mesh.vertices;
+        auto &indices  = loaded.mesh.indices;
+        auto &quads    = loaded.mesh.quad_indices;
+        if (vertices.capacity() == vertices.size()) vertices.reserve(vertices.size() + 1);
+        if (indices.capacity() == indices.size()) indices.reserve(indices.size() + 1);
+
+        loaded.load_ms = milliseconds_since(load_start);
+
+        // Every shape becomes its own geometries, so a hit's geomID is all it takes to find its
+        // material. Embree reads the mesh's own arrays instead of a copy of them, so they must
+        // not change for as long as the model's scene exists. We build a fresh scene, the one
+        // currently being rendered is left alone.
+        const auto build_start  = std::chrono::steady_clock::now();
+        loaded.scene            = _new_scene();
+        const auto new_geometry = [&](RTCGeometryType type) {
+            auto *geometry = rtcNewGeometry(_device, type);
+            rtcSetGeometryBuildQuality(geometry, build_settings(_build_profile).quality);
+            rtcSetSharedGeometryBuffer(
+              geometry,
+              RTC_BUFFER_TYPE_VERTEX,
+              0,
+              RTC_FORMAT_FLOAT3,
+              vertices.data(),
+              0,
+              sizeof(glm::vec3),
+              vertices.size());
+            return geometry;
+        };
+        const auto attach = [&](RTCGeometry geometry, uint32_t shape) {
+            rtcCommitGeometry(geometry);
+            rtcAttachGeometryByID(loaded.scene, geometry, loaded.geometry_materials.size());
+            rtcReleaseGeometry(geometry);
+            loaded.geometry_materials.push_back(shape);
+        };
+
+        // Quads stay quads, which halves the primitives of quad dominant models
+        const auto add_faces = [&](RTCGeometryType type, uint32_t shape) {
+            const auto  quad    = type == RTC_GEOMETRY_TYPE_QUAD;
+            const auto &offsets = quad ? loaded.mesh.quad_offsets : loaded.mesh.shape_offsets;
+            const auto &corners = quad ? quads : indices;
+            const auto  size    = quad ? 4 * sizeof(uint32_t) : 3 * sizeof(uint32_t);
+            const auto  first   = offsets[shape];
+            const auto  count   = offsets[shape + 1] - first;
+            if (count == 0) return;
+
+            auto *geometry = new_geometry(type);
+            rtcSetSharedGeometryBuffer(
+              geometry,
+              RTC_BUFFER_TYPE_INDEX,
+              0,
+              quad ? RTC_FORMAT_UINT4 : RTC_FORMAT_UINT3,
+              corners.data(),
+              first * size,
+              size,
+              count);
+            attach(geometry, shape);
+        };
+
+        // A subdivided shape's triangles and quads are the control cage of a single surface,
+        // which Embree tessellates lazily into its tessellation cache while tracing. Only the
+        // cage is kept in memory, however finely the surface is tessellated.
+        const auto add_surface = [&](uint32_t shape) {
+            const auto first_triangle = loaded.mesh.shape_offsets[shape];
+            const auto first_quad     = loaded.mesh.quad_offsets[shape];
+            const auto triangle_count = loaded.mesh.shape_offsets[shape + 1] - first_triangle;
+            const auto quad_count     = loaded.mesh.quad_offsets[shape + 1] - first_quad;
+            if (triangle_count + quad_count == 0) return;
+
+            auto *geometry = new_geometry(RTC_GEOMETRY_TYPE_SUBDIVISION);
+            rtcSetGeometryTessellationRate(geometry, _tessellation_rate);
+            auto *faces = static_cast<uint32_t *>(rtcSetNewGeometryBuffer(
+              geometry,
+              RTC_BUFFER_TYPE_FACE,
+              0,
+              RTC_FORMAT_UINT,
+              sizeof(uint32_t),
+              triangle_count + quad_count));
+            auto *cage = static_cast<uint32_t *>(rtcSetNewGeometryBuffer(
+              geometry,
+              RTC_BUFFER_TYPE_INDEX,
+              0,
+              RTC_FORMAT_UINT,
+              sizeof(uint32_t),
+              triangle_count * 3 + quad_count * 4));
+
+            std::fill_n(faces, triangle_count, 3u);
+            std::fill_n(faces + triangle_count, quad_count, 4u);
+            std::copy_n(indices.data() + first_triangle * 3, triangle_count * 3, cage);
+            std::copy_n(quads.data() + first_quad * 4, quad_count * 4, cage + triangle_count * 3);
+            attach(geometry, shape);
+        };
+
+        loaded.subdivided = _tessellation_rate > 0.f;
+        for (uint32_t shape = 0; shape < loaded.mesh.shape_count(); shape++)
         {
-            tinyobj::attrib_t                attrib;
-            std::vector<tinyobj::shape_t>    shapes;
-            std::vector<tinyobj::material_t> materials;
-            std::string                      warn;
-            std::string                      err;
-            const auto                       ret = tinyobj::LoadObj(
-              &attrib,
-              &shapes,
-              &materials,
-              &warn,
-              &err,
-              model.c_str(),
-              nullptr,
-              true);
-
-            if (!warn.empty()) std::cout << warn << std::endl;
-            if (!err.empty()) std::cerr << err << std::endl;
-            if (!ret) exit(-1);
-
-            if (attrib.vertices.size() % 3 != 0)
+            if (loaded.subdivided)
+                add_surface(shape);
+            else
             {
-                std::cerr << "Bad model lol" << std::endl;
-                exit(-1);
+                add_faces(RTC_GEOMETRY_TYPE_TRIANGLE, shape);
+                add_faces(RTC_GEOMETRY_TYPE_QUAD, shape);
             }
+        }
+        rtcCommitScene(loaded.scene);
+        loaded.build_ms = milliseconds_since(build_start);
+        return loaded;
+    }
+
+    void Renderer::load_envmap(const std::string &path)
+    {
+        auto loaded = _load_envmap_data(path);
+        if (!loaded.has_value()) return;
 
-            const auto vertex_count = attrib.vertices.size() / 3;
-            _vertices.reserve(vertex_count);
-            for (auto i = 0; i < attrib.vertices.size(); i += 3)
+        _envmap              = std::move(loaded->image);
+        _envmap_distribution = std::move(loaded->distribution);
+    }
+
+    void Renderer::_poll_envmap()
+    {
+        if (!_pending_envmap.valid()) return;
+        if (_pending_envmap.wait_for(std::chrono::seconds(0)) != std::future_status::ready) return;
+
+        auto loaded = _pending_envmap.get();
+        if (!loaded.has_value()) return;
+
+        // Drop the queued tiles and let the running ones finish, the workers stay alive
+        _render_pool.clear_tasks();
+        _render_pool.wait();
+        _envmap              = std::move(loaded->image);
+        _envmap_distribution = std::move(loaded->distribution);
+        _reset_accumulation();
+        _render_screen();
+    }
+
+    std::optional<Renderer::LoadedEnvmap> Renderer::_load_envmap_data(const std::string &path)
+    {
+        int  width, height, components;
+        auto envmap = Image();
+
+        // HDR files keep their full range, 8 bit images map to [0, 1] like they always have
+        if (stbi_is_hdr(path.c_str()))
+        {
+            auto *data = stbi_loadf(path.c_str(), &width, &height, &components, 3);
+            if (data == nullptr)
             {
-                _vertices.emplace_back(
-                  attrib.vertices[i + 0],
-                  attrib.vertices[i + 1],
-                  attrib.vertices[i + 2]);
+                std::cerr << "Failed to load envmap " << path << std::endl;
+                return {};
             }
-
-            for (const auto &shape : shapes)
+            envmap.data.assign(data, data + width * height * 3);
+            stbi_image_free(data);
+        }
+        else
+        {
+            auto *data = stbi_load(path.c_str(), &width, &height, &components, 3);
+            if (data == nullptr)
             {
-                _indices.reserve(shape.mesh.indices.size());
-                for (const auto idx : shape.mesh.indices) _indices.push_back(idx.vertex_index);
-                auto material           = Material();
-                material.name           = shape.name;
-                material.type           = Material::DIFFUSE;
-                material.reflectiveness = 1.f;
-                material.color          = glm::vec3(1.f, 1.f, 1.f);
-
-                _loaded_materials.push_back(std::move(material));
-
-                _material_indices.reserve(shape.mesh.indices.size() / 3);
-                for (auto f = 0; f < shape.mesh.num_face_vertices.size(); f++)
-                    _material_indices.push_back(_loaded_materials.size() - 1);
+                std::cerr << "Failed to load envmap " << path << std::endl;
+                return {};
             }
+            envmap.data.resize(width * height * 3);
+            for (size_t i = 0; i < envmap.data.size(); i++) envmap.data[i] = data[i] / 255.f;
+            stbi_image_free(data);
         }
 
-        // Once we're done loading the model into our indices / vertices / Todo: materials
-        // We rebuild the scene
-        auto *vertices = (float *) rtcSetNewGeometryBuffer(
-          _geometry,
-          RTC_BUFFER_TYPE_VERTEX,
-          0,
-          RTC_FORMAT_FLOAT3,
-          3 * sizeof(float),
-          _vertices.size());
+        envmap.width  = width;
+        envmap.height = height;
 
-        auto *indices = (unsigned *) rtcSetNewGeometryBuffer(
-          _geometry,
-          RTC_BUFFER_TYPE_INDEX,
-          0,
-          RTC_FORMAT_UINT3,
-          3 * sizeof(unsigned),
-          _indices.size());
+        auto loaded         = LoadedEnvmap();
+        loaded.distribution = _build_envmap_distribution(envmap);
+        loaded.image        = std::move(envmap);
+        return loaded;
+    }
 
-        if (vertices != nullptr)
-            std::memcpy(vertices, _vertices.data(), sizeof(glm::vec3) * _vertices.size());
+    Distribution2D Renderer::_build_envmap_distribution(const Image &envmap)
+    {
+        // Texel luminance, scaled by sin(theta) since rows near the poles cover less solid angle
+        const auto width   = envmap.width;
+        const auto height  = envmap.height;
+        auto       weights = std::vector<float>(width * height);
+        for (uint64_t y = 0; y < height; y++)
+        {
+            const auto sin_theta = sinf(3.1415f * (y + 0.5f) / height);
+            for (uint64_t x = 0; x < width; x++)
+                weights[x + y * width] = luminance(envmap.texel(x, y)) * sin_theta;
+        }
+        return Distribution2D(weights, width, height);
+    }
 
-        if (indices != nullptr)
-            std::memcpy(indices, _indices.data(), sizeof(uint32_t) * _indices.size());
+    bool Renderer::render_offline(const RayTracingContext &settings, const std::string &out_path)
+    {
+        _ray_tracing_context = settings;
 
-        _selected_material = nullptr;
-        rtcCommitGeometry(_geometry);
-        rtcAttachGeometry(_scene, _geometry);
-        rtcCommitScene(_scene);
+        auto &ctx        = _ray_tracing_context;
+        ctx.tiles.x_size = ctx.resolution.x / ctx.tiles.count;
+        ctx.tiles.y_size = ctx.resolution.y / ctx.tiles.count;
+        _reset_accumulation();
+
+        _ray_count    = 0;
+        _sample_count = 0;
+
+        // Kept out of the trace time
+        _commit_scene();
+
+        const auto pool_start = _render_pool.stats();
+
+        // A single pass unless a sample limit or adaptive sampling asks for more. Adaptive renders
+        // run until every pixel is converged or at the limit
+        const auto trace_start = std::chrono::steady_clock::now();
+        const auto trace_bytes = _device_bytes.load();
+        const auto target_spp  = _spp_limit() != 0 ? _spp_limit() : static_cast<uint32_t>(ctx.spp);
+        while (_accumulated_spp < target_spp && !_converged())
+        {
+            _render_screen();
+            _render_pool.wait();
+        }
+        _stats.trace_ms = milliseconds_since(trace_start);
+        _stats.rays     = _ray_count;
+        _stats.samples  = _sample_count;
+
+        // Subdivision surfaces are tessellated while tracing, which is kept apart from the BVHs
+        _stats.trace_bytes = _device_bytes - trace_bytes;
+
+        const auto pool_end = _render_pool.stats();
+        _stats.steals       = pool_end.steals - pool_start.steals;
+        _stats.idle_ms      = pool_end.idle_ms - pool_start.idle_ms;
+
+        const auto resolve_start = std::chrono::steady_clock::now();
+        _resolve_buffer();
+        _stats.resolve_ms = milliseconds_since(resolve_start);
+
+        return out_path.empty() || _export_image(out_path);
+    }
+
+    void Renderer::_reset_accumulation()
+    {
+        auto &     ctx         = _ray_tracing_context;
+        const auto pixel_count = ctx.resolution.x * ctx.resolution.y;
+        ctx.buffer.assign(pixel_count, 0);
+        ctx.accumulation.assign(pixel_count, glm::vec3(0, 0, 0));
+        ctx.luminance_squared.assign(pixel_count, 0.f);
+        ctx.sample_count.assign(pixel_count, 0);
+        _accumulated_spp = 0;
+    }
+
+    void Renderer::_resolve_buffer()
+    {
+        auto &ctx = _ray_tracing_context;
+        for (size_t i = 0; i < ctx.buffer.size(); i++)
+        {
+            const auto count = ctx.sample_count[i];
+            if (count == 0) continue;
+
+            const auto color = ctx.accumulation[i] / (float) count;
+            const auto r     = static_cast<uint32_t>(fminf(fmaxf(color.x, 0.f), 1.f) * 255.f);
+            const auto g     = static_cast<uint32_t>(fminf(fmaxf(color.y, 0.f), 1.f) * 255.f);
+            const auto b     = static_cast<uint32_t>(fminf(fmaxf(color.z, 0.f), 1.f) * 255.f);
+            ctx.buffer[i]    = r | g << 8 | b << 16 | 0xFFu << 24;
+        }
     }
 
     void Renderer::_render_screen(uint64_t spp)
     {
-        auto detail = RenderTaskDetail();
+        _commit_scene();
 
         const auto resolution = _ray_tracing_context.resolution;
         const auto tile_size  = _ray_tracing_context.tiles;
 
-        std::vector<std::function<void()>> tasks;
-#if 1
-        for (int j = 0; j * tile_size.y_size < resolution.y; ++j)
-            for (int i = 0; i * tile_size.x_size < resolution.x; ++i)
+        const auto columns = (resolution.x + tile_size.x_size - 1) / tile_size.x_size;
+        const auto rows    = (resolution.y + tile_size.y_size - 1) / tile_size.y_size;
+        _update_tile_order(columns, rows);
+        _render_pass         = _accumulated_spp;
+        _samples_before_pass = _sample_count;
+        _passes_started++;
+
+        // Chunks are handed out in order, a few per worker keeps the load balanced without paying
+        // for a dispatch per tile
+        const auto tile_count = static_cast<uint32_t>(_tile_order.size());
+        const auto threads    = _render_pool.thread_count();
+        auto       grain      = std::max(1u, tile_count / (threads * 4u));
+
+        // Wavefront chunks span enough tiles to fill a batch, as long as every worker gets one
+        const auto &ctx = _ray_tracing_context;
+        if (ctx.engine == RenderEngine::WAVEFRONT)
+        {
+            const auto tile_paths  = std::max(ctx.tiles.x_size * ctx.tiles.y_size * ctx.spp, 1);
+            const auto batch_tiles = (ctx.wavefront_size + tile_paths - 1) / tile_paths;
+            const auto per_worker  = std::max(1u, tile_count / threads);
+            grain = std::max(grain, std::min(static_cast<uint32_t>(batch_tiles), per_worker));
+        }
+
+        _render_pool.parallel_for(0, tile_count, grain, &Renderer::_render_tiles, this);
+
+        // Pixels stop at the limit even when it isn't a multiple of spp
+        const auto limit = _spp_limit();
+        _accumulated_spp += _ray_tracing_context.spp;
+        if (limit != 0) _accumulated_spp = std::min(_accumulated_spp, limit);
+    }
+
+    void Renderer::_update_tile_order(uint32_t columns, uint32_t rows)
+    {
+        const auto order = _ray_tracing_context.tile_order;
+        if (columns == _tile_columns && rows == _tile_rows && order == _tile_order_type &&
+            _tile_order.size() == columns * rows)
+            return;
+
+        _tile_columns    = columns;
+        _tile_rows       = rows;
+        _tile_order_type = order;
+        _tile_order.clear();
+        _tile_order.reserve(columns * rows);
+
+        if (order == TileOrder::HILBERT)
+        {
+            // Walk the curve over the smallest power of two square covering the grid and skip
+            // the cells that fall outside of it
+            auto n = 1u;
+            while (n < columns || n < rows) n *= 2;
+            for (auto d = 0u; d < n * n; d++)
             {
-                detail.x = i;
-                detail.y = j;
+                auto x = 0u;
+                auto y = 0u;
+                hilbert_d2xy(n, d, x, y);
+                if (x < columns && y < rows) _tile_order.push_back(x + y * columns);
+            }
+            return;
+        }
+
+        for (auto tile = 0u; tile < columns * rows; tile++) _tile_order.push_back(tile);
+        if (order == TileOrder::SCANLINE) return;
+
+        // Spiral: ring by ring around the image centre, each ring swept by angle
+        const auto ring_and_angle = [&](uint32_t tile) {
+            const auto dx = (tile % columns + 0.5f) - columns / 2.f;
+            const auto dy = (tile / columns + 0.5f) - rows / 2.f;
+            return std::make_pair(std::floor(std::max(std::abs(dx), std::abs(dy))), atan2f(dy, dx));
+        };
+        std::stable_sort(_tile_order.begin(), _tile_order.end(), [&](uint32_t a, uint32_t b) {
+            return ring_and_angle(a) < ring_and_angle(b);
+        });
+    }
 
-                tasks.emplace_back([detail, this] { _render_task(detail); });
+    HitRecord Renderer::_make_hit_record(
+      const Ray &      ray,
+      float            distance,
+      const glm::vec3 &geometry_normal,
+      uint32_t         instance_id,
+      uint32_t         geometry_id)
+    {
+        const auto &instance      = _instances[instance_id];
+        auto        record        = HitRecord();
+        record.hit                = true;
+        record.distance           = distance;
+        record.intersection_point = ray.point_at(distance);
+        record.normal             = glm::normalize(instance.normal_transform * geometry_normal);
+        record.hit_material       = &_loaded_materials[_material_index(instance_id, geometry_id)];
+        return record;
+    }
+
+    uint32_t Renderer::_material_index(uint32_t instance_id, uint32_t geometry_id) const
+    {
+        const auto &model = _models[_instances[instance_id].model];
+        return model.material_offset + model.geometry_materials[geometry_id];
+    }
+
+    void Renderer::_intersect_packet(const Ray *rays, const int *valid, HitRecord *records)
+    {
+        auto ctx = RTCIntersectContext();
+        rtcInitIntersectContext(&ctx);
+        ctx.flags = RTC_INTERSECT_CONTEXT_FLAG_COHERENT;
+
+        const auto trace = [&](auto &packet, const auto &intersect) {
+            const auto width = std::size(packet.ray.tfar);
+            for (size_t i = 0; i < width; i++)
+            {
+                packet.ray.org_x[i]     = rays[i].origin.x;
+                packet.ray.org_y[i]     = rays[i].origin.y;
+                packet.ray.org_z[i]     = rays[i].origin.z;
+                packet.ray.dir_x[i]     = rays[i].direction.x;
+                packet.ray.dir_y[i]     = rays[i].direction.y;
+                packet.ray.dir_z[i]     = rays[i].direction.z;
+                packet.ray.tnear[i]     = 0.f;
+                packet.ray.tfar[i]      = std::numeric_limits<float>::infinity();
+                packet.ray.time[i]      = 0.f;
+                packet.ray.mask[i]      = -1;
+                packet.ray.flags[i]     = 0;
+                packet.hit.geomID[i]    = RTC_INVALID_GEOMETRY_ID;
+                packet.hit.instID[0][i] = RTC_INVALID_GEOMETRY_ID;
             }
 
-        _render_pool.add_tasks(tasks);
-#else
-        detail.x = tile_count / 2;
-        detail.y = tile_count / 2;
-        for (int i = 0; i < tile_count * tile_count; ++i)
+            intersect(valid, _scene, &ctx, &packet);
+
+            for (size_t i = 0; i < width; i++)
+            {
+                records[i] = HitRecord();
+                if (!valid[i] || packet.hit.geomID[i] == RTC_INVALID_GEOMETRY_ID) continue;
+
+                records[i] = _make_hit_record(
+                  rays[i],
+                  packet.ray.tfar[i],
+                  glm::vec3(packet.hit.Ng_x[i], packet.hit.Ng_y[i], packet.hit.Ng_z[i]),
+                  packet.hit.instID[0][i],
+                  packet.hit.geomID[i]);
+            }
+        };
+
+        if (_packet_width == 16)
         {
-            _render_pool.add_task([detail, this] { _render_task(detail); });
-            if ((detail.x) <= (detail.y) && (detail.x != detail.y || detail.x >= 0))
-                detail.x += ((detail.y >= 0) ? 1 : -1);
-            else
-                detail.y += ((detail.x >= 0) ? -1 : 1);
+            auto packet = RTCRayHit16();
+            trace(packet, rtcIntersect16);
+        }
+        else
+        {
+            auto packet = RTCRayHit8();
+            trace(packet, rtcIntersect8);
         }
-#endif
     }
 
     HitRecord Renderer::_intersect_scene(const Ray &ray)
@@ -675,12 +1365,12 @@ namespace PT2
 
         if (ray_hit.hit.geomID != RTC_INVALID_GEOMETRY_ID)
         {
-            best.hit                = true;
-            best.distance           = ray_hit.ray.tfar;
-            best.intersection_point = ray.point_at(ray_hit.ray.tfar);
-            best.normal =
-              glm::normalize(glm::vec3(ray_hit.hit.Ng_x, ray_hit.hit.Ng_y, ray_hit.hit.Ng_z));
-            best.hit_material = &(_loaded_materials[_material_indices[ray_hit.hit.primID]]);
+            best = _make_hit_record(
+              ray,
+              ray_hit.ray.tfar,
+              glm::vec3(ray_hit.hit.Ng_x, ray_hit.hit.Ng_y, ray_hit.hit.Ng_z),
+              ray_hit.hit.instID[0],
+              ray_hit.hit.geomID);
         }
 
         return best;
@@ -758,14 +1448,16 @@ namespace PT2
         }
         else if (record.hit_material->type == Material::DIFFUSE)
         {
-            auto       new_ray = ray;
+            // Cosine weighted around the side the ray came from, the cosine and the pdf cancel so
+            // only the material colour is left to weight the bounce with
+            const auto normal =
+              glm::dot(ray.direction, record.normal) > 0.0f ? -record.normal : record.normal;
             const auto x       = rand_float();
             const auto y       = rand_float();
-            auto       sample  = cos_sample_hemisphere(x, y);
-            if (glm::dot(sample, record.normal) < 0.0f) sample *= -1.f;
-            new_ray.direction = glm::normalize(record.normal + sample);
-            new_ray.origin    = record.intersection_point + record.normal * 0.01f;
-            out_reflection    = fmaxf(0.f, glm::dot(record.normal, new_ray.direction));
+            auto       new_ray = ray;
+            new_ray.direction  = to_world(cos_sample_hemisphere(x, y), normal);
+            new_ray.origin     = record.intersection_point + normal * 0.01f;
+            out_reflection     = 1.f;
             return new_ray;
         }
         else if (record.hit_material->type == Material::METAL)
@@ -797,95 +1489,637 @@ namespace PT2
         }
     }
 
-    void Renderer::_render_task(RenderTaskDetail detail)
+    void Renderer::_render_tiles(void *renderer, uint32_t begin, uint32_t end)
     {
-        const auto x_max = detail.x - 1 == _ray_tracing_context.tiles.count
+        auto *self = static_cast<Renderer *>(renderer);
+
+        // Wavefront paths of every tile in the chunk share one queue, so batches aren't limited
+        // to a single tile's pixels
+        thread_local auto queue = PathQueue();
+        queue.size              = 0;
+
+        for (auto tile = begin; tile < end; tile++)
+        {
+            auto detail = RenderTaskDetail();
+            detail.x    = self->_tile_order[tile] % self->_tile_columns;
+            detail.y    = self->_tile_order[tile] / self->_tile_columns;
+            detail.pass = self->_render_pass;
+            self->_render_task(detail, queue);
+        }
+
+        if (queue.size > 0)
+        {
+            auto rays = uint64_t(0);
+            self->_trace_queue(queue, rays);
+            self->_ray_count += rays;
+        }
+    }
+
+    void Renderer::_render_task(RenderTaskDetail detail, PathQueue &queue)
+    {
+        auto tile  = TileBounds();
+        tile.x_max = detail.x - 1 == _ray_tracing_context.tiles.count
           ? _ray_tracing_context.resolution.x
           : std::min(
               detail.x * _ray_tracing_context.tiles.x_size + _ray_tracing_context.tiles.x_size,
               (int) _ray_tracing_context.resolution.x);
-        const auto y_max = detail.y - 1 == _ray_tracing_context.tiles.count
+        tile.y_max = detail.y - 1 == _ray_tracing_context.tiles.count
           ? _ray_tracing_context.resolution.y
           : std::min(
               detail.y * _ray_tracing_context.tiles.y_size + _ray_tracing_context.tiles.y_size,
               (int) _ray_tracing_context.resolution.y);
+        tile.x_min = detail.x * _ray_tracing_context.tiles.x_size;
+        tile.y_min = detail.y * _ray_tracing_context.tiles.y_size;
+
+        seed_rand(_ray_tracing_context.seed, detail.x, detail.y, detail.pass);
+        auto rays    = uint64_t(0);
+        auto samples = uint64_t(0);
+
+        if (_ray_tracing_context.engine == RenderEngine::WAVEFRONT)
+            _render_tile_wavefront(tile, queue, rays, samples);
+        else
+            _render_tile_megakernel(tile, rays, samples);
+
+        _ray_count += rays;
+        _sample_count += samples;
+    }
+
+    uint32_t Renderer::_spp_limit() const
+    {
+        // Some noise (caustics, fireflies) never gets below a tight threshold, so adaptive renders
+        // without a limit still stop here
+        constexpr auto adaptive_limit = 4096u;
+
+        const auto &ctx = _ray_tracing_context;
+        if (ctx.max_spp > 0) return static_cast<uint32_t>(ctx.max_spp);
+        return ctx.adaptive ? adaptive_limit : 0;
+    }
+
+    uint32_t Renderer::_pass_samples(uint64_t index) const
+    {
+        const auto &ctx     = _ray_tracing_context;
+        const auto  count   = ctx.sample_count[index];
+        const auto  max_spp = _spp_limit();
+        const auto  min_spp = static_cast<uint32_t>(std::max(ctx.min_spp, 2));
+        if (max_spp != 0 && count >= max_spp) return 0;
+
+        const auto spp      = static_cast<uint32_t>(ctx.spp);
+        const auto pass_spp = max_spp != 0 ? std::min(spp, max_spp - count) : spp;
+        if (!ctx.adaptive || count < min_spp) return pass_spp;
+
+        // Standard error of the pixel's mean luminance, relative to the mean. The mean is floored
+        // so near black pixels don't keep chasing noise nobody can see.
+        constexpr auto min_luminance = 0.05f;
+        constexpr auto min_threshold = 1e-4f;
+
+        const auto n         = (float) count;
+        const auto mean      = luminance(ctx.accumulation[index]) / n;
+        const auto variance  = fmaxf(ctx.luminance_squared[index] / n - mean * mean, 0.f);
+        const auto error     = sqrtf(variance / (n - 1.f));
+        const auto threshold = fmaxf(ctx.adaptive_threshold, min_threshold);
+        return error > threshold * fmaxf(mean, min_luminance) ? pass_spp : 0;
+    }
+
+    bool Renderer::_converged() const
+    {
+        return _accumulated_spp > 0 && _sample_count == _samples_before_pass;
+    }
 
-        for (uint64_t x = detail.x * _ray_tracing_context.tiles.x_size; x < x_max; x++)
+    void Renderer::_render_tile_megakernel(
+      const TileBounds &tile,
+      uint64_t &        rays,
+      uint64_t &        samples)
+    {
+        if (_ray_tracing_context.packet_primary && _packet_width > 1)
         {
-            for (uint64_t y = detail.y * _ray_tracing_context.tiles.y_size; y < y_max; y++)
+            // Primary rays of a small pixel block are coherent, so trace them as one packet and
+            // continue every lane through the regular bounce loop
+            const auto block_x = 4;
+            const auto block_y = _packet_width / block_x;
+
+            for (uint64_t bx = tile.x_min; bx < tile.x_max; bx += block_x)
             {
-                auto final_spp = glm::vec3(0, 0, 0);
-                for (auto spp = 0; spp < _ray_tracing_context.spp; spp++)
+                for (uint64_t by = tile.y_min; by < tile.y_max; by += block_y)
                 {
-                    auto ray = _ray_tracing_context.camera.get_ray(
-                      ((float) x + rand_float()) / _ray_tracing_context.resolution.x,
-                      ((float) y + rand_float()) / _ray_tracing_context.resolution.y);
-                    auto throughput = glm::vec3(1, 1, 1);
-                    auto final      = glm::vec3(0, 0, 0);
+                    uint64_t  indices[16];
+                    uint32_t  lane_spp[16];
+                    glm::vec3 final_spp[16];
+                    float     moment[16];
+                    alignas(64) int valid[16];
+
+                    auto active = 0;
+                    for (auto lane = 0; lane < _packet_width; lane++)
+                    {
+                        const auto x      = bx + lane % block_x;
+                        const auto y      = by + lane / block_x;
+                        const auto inside = x < tile.x_max && y < tile.y_max;
+                        indices[lane]     = x + y * _ray_tracing_context.resolution.x;
+                        lane_spp[lane]    = inside ? _pass_samples(indices[lane]) : 0;
+                        valid[lane]       = lane_spp[lane] > 0 ? -1 : 0;
+                        final_spp[lane]   = glm::vec3(0, 0, 0);
+                        moment[lane]      = 0.f;
+                        if (valid[lane]) active++;
+                    }
+                    if (active == 0) continue;
 
-                    for (auto bounce = 0; bounce < _ray_tracing_context.bounces; bounce++)
+                    for (uint32_t spp = 0;; spp++)
                     {
-                        auto current = _intersect_scene(ray);
+                        // Lanes drop out of the packet once they took their samples for the pass
+                        for (auto lane = 0; lane < _packet_width; lane++)
+                        {
+                            if (!valid[lane] || spp < lane_spp[lane]) continue;
+                            valid[lane] = 0;
+                            active--;
+                        }
+                        if (active == 0) break;
 
-                        if (!current.hit)
+                        Ray       primary[16] = {};
+                        HitRecord records[16];
+                        for (auto lane = 0; lane < _packet_width; lane++)
                         {
-                            // We didn't intersect anything, so lets get the skybox colour and dip
-                            // out of here.
-                            auto skybox_uv = glm::vec2(
-                              0.5f + atan2f(ray.direction.z, ray.direction.x) / (2 * 3.1415),
-                              0.5f - asinf(ray.direction.y) / 3.1415);
-
-                            if (_envmap.has_value())
-                            {
-                                const uint64_t u     = skybox_uv.x * _envmap->width;
-                                const uint64_t v     = skybox_uv.y * _envmap->height;
-                                const auto     index = u + v * _envmap->width;
-                                const auto     out   = glm::vec3(
-                                  _envmap->data[index * 3 + 0] / 255.f,
-                                  _envmap->data[index * 3 + 1] / 255.f,
-                                  _envmap->data[index * 3 + 2] / 255.f);
-                                final += throughput * out;
-                            }
-                            else
-                            {
-                                const auto blue  = glm::vec3(0.4, 0.4, 1.0);
-                                const auto white = glm::vec3(1, 1, 1);
-                                const auto out   = glm::mix(white, blue, skybox_uv.y);
-                                final += throughput * out;
-                            }
-                            break;
+                            if (!valid[lane]) continue;
+                            const auto x  = bx + lane % block_x;
+                            const auto y  = by + lane / block_x;
+                            primary[lane] = _ray_tracing_context.camera.get_ray(
+                              ((float) x + rand_float()) / _ray_tracing_context.resolution.x,
+                              ((float) y + rand_float()) / _ray_tracing_context.resolution.y);
                         }
-                        else
+
+                        _intersect_packet(primary, valid, records);
+                        rays += active;
+
+                        for (auto lane = 0; lane < _packet_width; lane++)
                         {
-                            auto reflection = -1.f;
-                            ray             = _process_hit(current, ray, reflection);
-                            if (_loaded_materials.empty())
-                            {
-                                final += throughput * 0.3f;
-                                throughput *= glm::vec3(1, 1, 1) * .2f;
-                            }
-                            else
-                            {
-                                final += throughput * current.hit_material->emission *
-                                  current.hit_material->color;
-                                throughput *= current.hit_material->color * reflection;
-                            }
+                            if (!valid[lane]) continue;
+                            const auto sample = _trace_path(primary[lane], records[lane], rays);
+                            final_spp[lane] += sample;
+                            moment[lane] += luminance(sample) * luminance(sample);
                         }
                     }
-                    final_spp += final;
+
+                    for (auto lane = 0; lane < _packet_width; lane++)
+                    {
+                        if (lane_spp[lane] == 0) continue;
+                        _ray_tracing_context.accumulation[indices[lane]] += final_spp[lane];
+                        _ray_tracing_context.luminance_squared[indices[lane]] += moment[lane];
+                        _ray_tracing_context.sample_count[indices[lane]] += lane_spp[lane];
+                        samples += lane_spp[lane];
+                    }
+                }
+            }
+        }
+        else
+        {
+            for (uint64_t x = tile.x_min; x < tile.x_max; x++)
+            {
+                for (uint64_t y = tile.y_min; y < tile.y_max; y++)
+                {
+                    const auto index     = (x + y * _ray_tracing_context.resolution.x);
+                    const auto pixel_spp = _pass_samples(index);
+                    if (pixel_spp == 0) continue;
+
+                    auto final_spp = glm::vec3(0, 0, 0);
+                    auto moment    = 0.f;
+                    for (uint32_t spp = 0; spp < pixel_spp; spp++)
+                    {
+                        const auto ray = _ray_tracing_context.camera.get_ray(
+                          ((float) x + rand_float()) / _ray_tracing_context.resolution.x,
+                          ((float) y + rand_float()) / _ray_tracing_context.resolution.y);
+
+                        rays++;
+                        const auto sample = _trace_path(ray, _intersect_scene(ray), rays);
+                        final_spp += sample;
+                        moment += luminance(sample) * luminance(sample);
+                    }
+
+                    _ray_tracing_context.accumulation[index] += final_spp;
+                    _ray_tracing_context.luminance_squared[index] += moment;
+                    _ray_tracing_context.sample_count[index] += pixel_spp;
+                    samples += pixel_spp;
+                }
+            }
+        }
+    }
+
+    void Renderer::_render_tile_wavefront(
+      const TileBounds &tile,
+      PathQueue &       queue,
+      uint64_t &        rays,
+      uint64_t &        samples)
+    {
+        const auto &ctx        = _ray_tracing_context;
+        const auto  batch_size = static_cast<uint32_t>(std::max(ctx.wavefront_size, ctx.spp));
+        queue.reserve(batch_size);
+
+        // Camera generation stage, the queue carries over to the next tile of the chunk and is
+        // only traced once it can't fit another pixel's samples
+        for (uint64_t x = tile.x_min; x < tile.x_max; x++)
+        {
+            for (uint64_t y = tile.y_min; y < tile.y_max; y++)
+            {
+                const auto index     = (x + y * ctx.resolution.x);
+                const auto pixel_spp = _pass_samples(index);
+                if (pixel_spp == 0) continue;
+
+                if (queue.size + pixel_spp > batch_size) _trace_queue(queue, rays);
+                for (uint32_t spp = 0; spp < pixel_spp; spp++)
+                {
+                    queue.push(
+                      ctx.camera.get_ray(
+                        ((float) x + rand_float()) / ctx.resolution.x,
+                        ((float) y + rand_float()) / ctx.resolution.y),
+                      index);
+                }
+
+                _ray_tracing_context.sample_count[index] += pixel_spp;
+                samples += pixel_spp;
+            }
+        }
+    }
+
+    void Renderer::_trace_queue(PathQueue &queue, uint64_t &rays)
+    {
+        thread_local auto order = std::vector<uint32_t>();
+
+        const auto &ctx = _ray_tracing_context;
+
+        auto intersect_context = RTCIntersectContext();
+        rtcInitIntersectContext(&intersect_context);
+
+        const auto retire = [&](uint32_t i) {
+            const auto sample_luminance = luminance(queue.radiance[i]);
+            _ray_tracing_context.accumulation[queue.pixel[i]] += queue.radiance[i];
+            _ray_tracing_context.luminance_squared[queue.pixel[i]] +=
+              sample_luminance * sample_luminance;
+        };
+
+        for (auto bounce = 0; bounce < ctx.bounces && queue.size > 0; bounce++)
+        {
+            // Intersection stage
+            auto ray_hit = queue.ray_hit();
+            rtcIntersectNp(_scene, &intersect_context, &ray_hit, queue.size);
+            rays += queue.size;
+
+            // Miss stage, escaped paths pick up the background and leave the queue
+            auto alive = uint32_t(0);
+            for (uint32_t i = 0; i < queue.size; i++)
+            {
+                if (queue.hit(i))
+                {
+                    if (alive != i) queue.move(i, alive);
+                    alive++;
+                    continue;
                 }
 
-                final_spp /= _ray_tracing_context.spp;
-                const auto index = (x + y * _ray_tracing_context.resolution.x);
+                const auto direction  = queue.ray(i).direction;
+                const auto background = _miss_radiance(direction, queue.scatter_pdf[i]);
+                queue.radiance[i] += queue.throughput[i] * background;
+                retire(i);
+            }
+            queue.size = alive;
+
+            // Shading stage, grouped by material so each material's branch of _process_hit
+            // runs over a contiguous run of hits
+            _sort_by_material(queue, order);
+            for (const auto i : order)
+            {
+                auto       ray    = queue.ray(i);
+                const auto record = _make_hit_record(
+                  ray,
+                  queue.tfar[i],
+                  glm::vec3(queue.ng_x[i], queue.ng_y[i], queue.ng_z[i]),
+                  queue.inst_id[i],
+                  queue.geom_id[i]);
+                _shade_hit(
+                  record,
+                  ray,
+                  queue.throughput[i],
+                  queue.radiance[i],
+                  queue.scatter_pdf[i],
+                  rays);
+                if (!_survives_roulette(bounce, queue.throughput[i]))
+                    queue.throughput[i] = glm::vec3(0, 0, 0);
+                queue.set_ray(i, ray);
+            }
+
+            // Paths that can't gather anything more (roulette or a black surface) retire
+            // before the next intersection stage instead of paying for another traversal
+            alive = 0;
+            for (uint32_t i = 0; i < queue.size; i++)
+            {
+                if (queue.throughput[i] == glm::vec3(0, 0, 0))
+                {
+                    retire(i);
+                    continue;
+                }
+
+                if (alive != i) queue.move(i, alive);
+                alive++;
+            }
+            queue.size = alive;
+        }
+
+        // Paths that ran out of bounces keep whatever they gathered so far
+        for (uint32_t i = 0; i < queue.size; i++) retire(i);
+        queue.size = 0;
+    }
+
+    void Renderer::_sort_by_material(const PathQueue &queue, std::vector<uint32_t> &order) const
+    {
+        order.resize(queue.size);
+        if (!_ray_tracing_context.sort_by_material || _loaded_materials.empty())
+        {
+            for (uint32_t i = 0; i < queue.size; i++) order[i] = i;
+            return;
+        }
+
+        // Rank every material by (type, index) so the buckets come out grouped by type first
+        thread_local auto bucket_of = std::vector<uint32_t>();
+        thread_local auto offsets   = std::vector<uint32_t>();
+        bucket_of.resize(_loaded_materials.size());
+        offsets.assign(_loaded_materials.size() + 1, 0);
+
+        constexpr Material::Type types[] = {
+            Material::DIFFUSE,
+            Material::REFRACTIVE,
+            Material::MIRROR,
+            Material::METAL,
+        };
+
+        auto rank = uint32_t(0);
+        for (const auto type : types)
+            for (size_t m = 0; m < _loaded_materials.size(); m++)
+                if (_loaded_materials[m].type == type) bucket_of[m] = rank++;
+
+        // Counting sort of the hits by bucket
+        const auto bucket = [&](uint32_t i) {
+            return bucket_of[_material_index(queue.inst_id[i], queue.geom_id[i])];
+        };
+        for (uint32_t i = 0; i < queue.size; i++) offsets[bucket(i) + 1]++;
+        for (size_t b = 1; b < offsets.size(); b++) offsets[b] += offsets[b - 1];
+        for (uint32_t i = 0; i < queue.size; i++) order[offsets[bucket(i)]++] = i;
+    }
+
+    glm::vec3 Renderer::_trace_path(Ray ray, HitRecord current, uint64_t &rays)
+    {
+        auto throughput  = glm::vec3(1, 1, 1);
+        auto final       = glm::vec3(0, 0, 0);
+        auto scatter_pdf = 0.f;
+
+        for (auto bounce = 0; bounce < _ray_tracing_context.bounces; bounce++)
+        {
+            if (bounce > 0)
+            {
+                current = _intersect_scene(ray);
+                rays++;
+            }
+
+            if (!current.hit)
+            {
+                // We didn't intersect anything, so lets get the skybox colour and dip
+                // out of here.
+                final += throughput * _miss_radiance(ray.direction, scatter_pdf);
+                break;
+            }
+
+            _shade_hit(current, ray, throughput, final, scatter_pdf, rays);
+            if (!_survives_roulette(bounce, throughput)) break;
+        }
+
+        return final;
+    }
+
+    bool Renderer::_survives_roulette(int bounce, glm::vec3 &throughput) const
+    {
+        const auto &ctx = _ray_tracing_context;
+        if (!ctx.russian_roulette || bounce + 1 < ctx.rr_min_depth) return true;
+
+        // Survival follows the throughput, floored so bright paths behind a dark bounce still get
+        // a chance to reach a light
+        const auto probability = std::clamp(luminance(throughput), 0.05f, 1.f);
+        if (rand_float() >= probability) return false;
+
+        throughput /= probability;
+        return true;
+    }
+
+    glm::vec3 Renderer::_sample_background(const glm::vec3 &direction) const
+    {
+        const auto skybox_uv = direction_to_uv(direction);
+
+        if (_envmap.has_value()) return _envmap->sample(skybox_uv.x, skybox_uv.y);
+
+        const auto blue  = glm::vec3(0.4, 0.4, 1.0);
+        const auto white = glm::vec3(1, 1, 1);
+        return glm::mix(white, blue, skybox_uv.y);
+    }
+
+    glm::vec3 Renderer::_miss_radiance(const glm::vec3 &direction, float scatter_pdf) const
+    {
+        const auto background = _sample_background(direction);
+        if (scatter_pdf == 0.f || _envmap_distribution.empty()) return background;
+        return background * power_heuristic(scatter_pdf, _envmap_pdf(direction));
+    }
+
+    float Renderer::_envmap_pdf(const glm::vec3 &direction) const
+    {
+        // The distribution lives in uv space, the mapping stretches it by 2 pi^2 sin(theta)
+        const auto uv        = direction_to_uv(direction);
+        const auto sin_theta = sinf(uv.y * 3.1415f);
+        if (sin_theta <= 0.f) return 0.f;
+        return _envmap_distribution.density(uv) / (2.f * 3.1415f * 3.1415f * sin_theta);
+    }
+
+    void Renderer::_shade_hit(
+      const HitRecord &record,
+      Ray &            ray,
+      glm::vec3 &      throughput,
+      glm::vec3 &      radiance,
+      float &          scatter_pdf,
+      uint64_t &       rays)
+    {
+        const auto incoming   = ray.direction;
+        auto       reflection = -1.f;
+        ray                   = _process_hit(record, ray, reflection);
+        if (_loaded_materials.empty())
+        {
+            radiance += throughput * 0.3f;
+            throughput *= glm::vec3(1, 1, 1) * .2f;
+            return;
+        }
+
+        // Emitters reached from a vertex that sampled the lights were already counted there, as
+        // long as they're in the light list
+        const auto &material = *record.hit_material;
+        const auto  sampled  = _sampled_lights[record.hit_material - _loaded_materials.data()];
+        if (scatter_pdf == 0.f || !sampled)
+            radiance += throughput * material.emission * material.color;
+        scatter_pdf = 0.f;
+
+        // Metal's lobe has no pdf we could evaluate and the rest are specular, so only diffuse
+        // surfaces sample the lights directly
+        const auto has_lights = !_light_distribution.empty() || !_envmap_distribution.empty();
+        if (_ray_tracing_context.next_event && material.type == Material::DIFFUSE && has_lights)
+        {
+            const auto normal =
+              glm::dot(incoming, record.normal) > 0.f ? -record.normal : record.normal;
+            if (!_light_distribution.empty())
+                radiance += throughput * _sample_lights(record, normal, rays);
+            if (!_envmap_distribution.empty())
+                radiance += throughput * _sample_envmap(record, normal, rays);
+            scatter_pdf = fmaxf(glm::dot(normal, ray.direction), 1e-6f) / 3.1415f;
+        }
 
-                _ray_tracing_context.buffer[index] |= static_cast<uint8_t>(final_spp[0] * 255.f);
-                _ray_tracing_context.buffer[index] |= static_cast<uint8_t>(final_spp[1] * 255.f)
-                  << 8;
-                _ray_tracing_context.buffer[index] |= static_cast<uint8_t>(final_spp[2] * 255.f)
-                  << 16;
-                _ray_tracing_context.buffer[index] |= static_cast<uint8_t>(~0) << 24;
+        throughput *= material.color * reflection;
+    }
+
+    void Renderer::_build_light_list()
+    {
+        // Emissive shapes are found once per model, then placed once per instance. Subdivision
+        // surfaces are left out, sampling their cage would put the light somewhere rays don't
+        // hit it, so their emission is only found by paths that hit them.
+        auto emitters = std::vector<std::vector<uint32_t>>(_models.size());
+        for (size_t m = 0; m < _models.size(); m++)
+        {
+            if (_models[m].subdivided) continue;
+
+            for (uint32_t shape = 0; shape < _models[m].mesh.shape_count(); shape++)
+            {
+                const auto &material = _loaded_materials[_models[m].material_offset + shape];
+                if (luminance(material.emission * material.color) > 0.f)
+                    emitters[m].push_back(shape);
+            }
+        }
+
+        _light_triangles.clear();
+        _sampled_lights.assign(_loaded_materials.size(), 0);
+        auto weights = std::vector<float>();
+        for (const auto &instance : _instances)
+        {
+            const auto &model = _models[instance.model];
+            const auto &mesh  = model.mesh;
+            for (const auto shape : emitters[instance.model])
+            {
+                const auto &material = _loaded_materials[model.material_offset + shape];
+                const auto  power    = luminance(material.emission * material.color);
+                const auto add_light = [&](const uint32_t *corners, int a, int b, int c) {
+                    const auto place = [&](int corner) {
+                        const auto &vertex = mesh.vertices[corners[corner]];
+                        return glm::vec3(instance.transform * glm::vec4(vertex, 1.f));
+                    };
+
+                    auto light     = LightTriangle();
+                    light.v0       = place(a);
+                    light.v1       = place(b);
+                    light.v2       = place(c);
+                    light.material = model.material_offset + shape;
+
+                    const auto cross = glm::cross(light.v1 - light.v0, light.v2 - light.v0);
+                    const auto area  = glm::length(cross) * 0.5f;
+                    if (area <= 0.f) return;
+
+                    _light_triangles.push_back(light);
+                    weights.push_back(area * power);
+                    _sampled_lights[light.material] = 1;
+                };
+
+                // Quads are sampled as the two triangles Embree splits them into
+                for (auto t = mesh.shape_offsets[shape]; t < mesh.shape_offsets[shape + 1]; t++)
+                    add_light(&mesh.indices[t * 3], 0, 1, 2);
+                for (auto q = mesh.quad_offsets[shape]; q < mesh.quad_offsets[shape + 1]; q++)
+                {
+                    add_light(&mesh.quad_indices[q * 4], 0, 1, 3);
+                    add_light(&mesh.quad_indices[q * 4], 2, 3, 1);
+                }
             }
         }
+        _light_distribution = Distribution1D(weights);
+    }
+
+    glm::vec3 Renderer::_sample_lights(
+      const HitRecord &record,
+      const glm::vec3 &normal,
+      uint64_t &       rays)
+    {
+        auto       pick_probability = 0.f;
+        const auto light            = _light_distribution.sample(rand_float(), pick_probability);
+        const auto &triangle        = _light_triangles[light];
+
+        const auto &v0          = triangle.v0;
+        const auto &v1          = triangle.v1;
+        const auto &v2          = triangle.v2;
+        const auto  barycentric = sample_triangle(rand_float(), rand_float());
+        const auto  point       = v0 + (v1 - v0) * barycentric.x + (v2 - v0) * barycentric.y;
+        const auto  cross       = glm::cross(v1 - v0, v2 - v0);
+        const auto  area        = glm::length(cross) * 0.5f;
+
+        const auto origin     = record.intersection_point + normal * 0.01f;
+        const auto to_light   = point - origin;
+        const auto distance_2 = glm::dot(to_light, to_light);
+        const auto distance   = sqrtf(distance_2);
+        const auto direction  = to_light / distance;
+
+        // Emitters are two sided, like when a path hits them
+        const auto cos_surface = glm::dot(normal, direction);
+        const auto cos_light   = fabsf(glm::dot(cross, direction)) / (2.f * area);
+        if (cos_surface <= 0.f || cos_light <= 0.f) return glm::vec3(0, 0, 0);
+
+        rays++;
+        if (_occluded(origin, direction, distance - 0.01f)) return glm::vec3(0, 0, 0);
+
+        // Lambertian BSDF, with the area pdf of the sample converted to solid angle
+        const auto &material  = *record.hit_material;
+        const auto &light_mat = _loaded_materials[triangle.material];
+        const auto  emitted   = light_mat.emission * light_mat.color;
+        const auto  pdf       = pick_probability / area * distance_2 / cos_light;
+        return material.color / 3.1415f * emitted * cos_surface / pdf;
+    }
+
+    glm::vec3 Renderer::_sample_envmap(
+      const HitRecord &record,
+      const glm::vec3 &normal,
+      uint64_t &       rays)
+    {
+        auto       uv_density  = 0.f;
+        const auto uv          = _envmap_distribution.sample(rand_float(), rand_float(), uv_density);
+        const auto direction   = uv_to_direction(uv);
+        const auto sin_theta   = sinf(uv.y * 3.1415f);
+        const auto cos_surface = glm::dot(normal, direction);
+        if (uv_density <= 0.f || sin_theta <= 0.f || cos_surface <= 0.f)
+            return glm::vec3(0, 0, 0);
+
+        const auto origin = record.intersection_point + normal * 0.01f;
+        rays++;
+        if (_occluded(origin, direction, std::numeric_limits<float>::infinity()))
+            return glm::vec3(0, 0, 0);
+
+        const auto pdf      = uv_density / (2.f * 3.1415f * 3.1415f * sin_theta);
+        const auto bsdf_pdf = cos_surface / 3.1415f;
+        const auto weight   = power_heuristic(pdf, bsdf_pdf);
+        return record.hit_material->color / 3.1415f * _sample_background(direction) * cos_surface *
+          weight / pdf;
+    }
+
+    bool Renderer::_occluded(const glm::vec3 &origin, const glm::vec3 &direction, float distance)
+    {
+        auto ctx = RTCIntersectContext();
+        rtcInitIntersectContext(&ctx);
+        auto ray  = RTCRay();
+        ray.org_x = origin.x;
+        ray.org_y = origin.y;
+        ray.org_z = origin.z;
+        ray.dir_x = direction.x;
+        ray.dir_y = direction.y;
+        ray.dir_z = direction.z;
+        ray.tnear = 0.f;
+        ray.tfar  = distance;
+        ray.mask  = -1;
+        ray.flags = 0;
+        ray.time  = 0.f;
+
+        // Embree sets tfar to -inf when anything is in the way
+        rtcOccluded1(_scene, &ctx, &ray);
+        return ray.tfar < 0.f;
     }
 }    // namespace PT2
      /*
@@ -11,8 +11,11 @@
 #include <shared_mutex>
 #include <embree3/rtcore.h>
 #include <filesystem>
+#include <future>
 
 #include <pt2/structs.h>
+#include <pt2/path_queue.h>
+#include <pt2/sampling.h>
 #include <pt2/thread_pool.h>
 
 #include <glad/glad.h>
@@ -37,14 +40,58 @@ namespace PT2
     class Renderer
     {
     public:
-        Renderer();
+        explicit Renderer(uint32_t thread_count = 16);
 
         ~Renderer();
 
         void start_gui();
 
+        // Replaces the scene with a single copy of model, exits when it can't be loaded
         void load_model(const std::string &model, ModelType model_type);
 
+        // Places another copy of model in the scene and returns its instance id. Every model is
+        // only parsed and built once, further copies reference its scene through an instance.
+        std::optional<uint32_t> add_model(
+          const std::string &model,
+          ModelType          model_type,
+          const glm::mat4 &  transform = glm::mat4(1.f));
+
+        // Places a set of spheres or discs in the scene as Embree point geometry and returns its
+        // instance id. Each call builds its own scene. Emissive points aren't sampled as lights,
+        // their emission is only found by paths that hit them.
+        uint32_t add_points(PointSet points, const glm::mat4 &transform = glm::mat4(1.f));
+
+        // Removes every model, the renderer must not be rendering
+        void clear_scene();
+
+        // Takes effect from the next clear_scene / load_model on, models that are already built
+        // keep their BVHs
+        void set_build_profile(BuildProfile profile) noexcept { _build_profile = profile; }
+
+        // 0 builds models from their triangles and quads. Anything above loads each shape as the
+        // control cage of a Catmull-Clark surface, tessellated into that many segments per cage
+        // edge. Like the build profile it only applies to models loaded afterwards.
+        void set_subdivision(float tessellation_rate) noexcept
+        {
+            _tessellation_rate = tessellation_rate;
+        }
+
+        void load_envmap(const std::string &path);
+
+        // Renders the currently loaded scene with the given settings and writes the result to
+        // out_path, without ever touching GLFW / OpenGL / ImGui.
+        // An empty out_path skips writing the image. Returns false if the image couldn't be
+        // written.
+        bool render_offline(const RayTracingContext &settings, const std::string &out_path);
+
+        // True for the png, bmp and jpg / jpeg extensions and for no extension at all (jpg)
+        [[nodiscard]] static bool supported_image(const std::string &path);
+
+        [[nodiscard]] const RenderStats &stats() const noexcept { return _stats; }
+
+        // Render workers actually running, never less than one
+        [[nodiscard]] uint32_t thread_count() const noexcept { return _render_pool.thread_count(); }
+
     private:
         static void _read_file(const std::string &path, std::string &contents);
 
@@ -54,17 +101,193 @@ namespace PT2
 
         void _update_uniforms() const;
 
+        // Writes a png, bmp or jpg depending on the extension (jpg without one), false on failure
+        bool _export_image(const std::string &path) const;
+
         void _render_screen(uint64_t spp = 0);
 
-        void _render_task(RenderTaskDetail detail);
+        // Rebuilds _tile_order when the tile grid or the requested order changed
+        void _update_tile_order(uint32_t columns, uint32_t rows);
+
+        void _reset_accumulation();
+
+        void _resolve_buffer();
+
+        // ThreadPool::RangeFunction over tile indices of the current pass
+        static void _render_tiles(void *renderer, uint32_t begin, uint32_t end);
+
+        // queue holds the chunk's wavefront paths, unused by the megakernel
+        void _render_task(RenderTaskDetail detail, PathQueue &queue);
+
+        // One path per pixel sample at a time, first hits optionally traced as ray packets
+        void _render_tile_megakernel(const TileBounds &tile, uint64_t &rays, uint64_t &samples);
+
+        // Queues the tile's camera paths, tracing the queue whenever it holds wavefront_size
+        void _render_tile_wavefront(
+          const TileBounds &tile,
+          PathQueue &       queue,
+          uint64_t &        rays,
+          uint64_t &        samples);
+
+        // Runs every queued path to completion stage by stage, traced as ray streams
+        void _trace_queue(PathQueue &queue, uint64_t &rays);
+
+        // Samples a pixel may reach, max_spp or a hard cap for adaptive renders, 0 = no limit
+        [[nodiscard]] uint32_t _spp_limit() const;
+
+        // Samples the pixel takes this pass, at most spp and never past the limit, 0 = done
+        [[nodiscard]] uint32_t _pass_samples(uint64_t index) const;
+
+        // True once a finished pass didn't add a single sample, only meaningful while idle
+        [[nodiscard]] bool _converged() const;
+
+        // Fills order with the queue's (all hit) paths bucketed by material type and index
+        void _sort_by_material(const PathQueue &queue, std::vector<uint32_t> &order) const;
 
         void _initialize();
 
+        // Empty scene with the build quality and flags of _build_profile
+        [[nodiscard]] RTCScene _new_scene() const;
+
         [[nodiscard]] Ray _process_hit(const HitRecord &record, const Ray &ray, float &reflection);
 
         [[nodiscard]] HitRecord _intersect_scene(const Ray &ray);
 
-        GLFWwindow *_window;
+        // Traces _packet_width primary rays at once, lanes with valid[i] == 0 are ignored
+        void _intersect_packet(const Ray *rays, const int *valid, HitRecord *records);
+
+        // geometry_normal is in the object space of the instance that was hit
+        [[nodiscard]] HitRecord _make_hit_record(
+          const Ray &      ray,
+          float            distance,
+          const glm::vec3 &geometry_normal,
+          uint32_t         instance_id,
+          uint32_t         geometry_id);
+
+        // Index into _loaded_materials of a geometry in the given instance's model
+        [[nodiscard]] uint32_t _material_index(uint32_t instance_id, uint32_t geometry_id) const;
+
+        // Runs the bounce loop for a path whose first intersection is already known
+        [[nodiscard]] glm::vec3 _trace_path(Ray ray, HitRecord current, uint64_t &rays);
+
+        [[nodiscard]] glm::vec3 _sample_background(const glm::vec3 &direction) const;
+
+        // Background seen by a path that escaped, MIS weighted against environment sampling when
+        // the vertex it left from also sampled the envmap directly
+        [[nodiscard]] glm::vec3 _miss_radiance(const glm::vec3 &direction, float scatter_pdf) const;
+
+        // Solid angle pdf of _sample_envmap picking direction
+        [[nodiscard]] float _envmap_pdf(const glm::vec3 &direction) const;
+
+        // A model parsed into its own, fully built Embree scene, which every copy of the model
+        // placed in _scene instances. Each of the mesh's shapes is a geometry in that scene,
+        // reading the mesh's arrays in place. Its materials live in _loaded_materials from
+        // material_offset on. Point sets are models with a single shape and no faces, whose
+        // geometry reads points instead.
+        struct LoadedModel
+        {
+            std::string            path;
+            RTCScene               scene = nullptr;
+            Mesh                   mesh;
+            std::vector<glm::vec4> points;
+            std::vector<uint32_t>  geometry_materials;    // Material of each geometry, by geomID
+            uint32_t               material_offset = 0;
+            bool                   subdivided      = false;    // Shapes are subdivision cages
+            double                 load_ms         = 0.0;
+            double                 build_ms        = 0.0;
+
+            // Embree points into mesh and points, which a move keeps in place but a copy doesn't
+            LoadedModel()                               = default;
+            LoadedModel(LoadedModel &&)                 = default;
+            LoadedModel &operator=(LoadedModel &&)      = default;
+            LoadedModel(const LoadedModel &)            = delete;
+            LoadedModel &operator=(const LoadedModel &) = delete;
+        };
+
+        // One placed copy of a model, its id is its geometry id in _scene
+        struct Instance
+        {
+            uint32_t  model;
+            glm::mat4 transform;
+            glm::mat3 normal_transform;
+        };
+
+        // Parses the model and builds a new scene for it, leaving the current one untouched so
+        // it can run on a background thread while rendering continues
+        [[nodiscard]] std::optional<LoadedModel>
+          _load_model_data(const std::string &model, ModelType model_type) const;
+
+        [[nodiscard]] std::optional<uint32_t> _find_model(const std::string &model) const;
+
+        // Takes ownership of a loaded model and returns its index, without placing it anywhere
+        uint32_t _add_model(LoadedModel &&loaded);
+
+        // Places a copy of _models[model] in _scene, the pool must not be running any tiles. It's
+        // traced once _commit_scene ran.
+        uint32_t _add_instance(uint32_t model, const glm::mat4 &transform);
+
+        // Commits _scene and rebuilds the light list if instances were added since the last
+        // commit, the pool must not be running any tiles
+        void _commit_scene();
+
+        // Places a finished background model load, called at frame boundaries
+        void _poll_model();
+
+        struct LoadedEnvmap
+        {
+            Image          image;
+            Distribution2D distribution;
+        };
+
+        // Decodes the envmap and builds its sampling distribution without touching the renderer,
+        // so it can run on a background thread
+        [[nodiscard]] static std::optional<LoadedEnvmap> _load_envmap_data(const std::string &path);
+
+        // Builds the luminance distribution _sample_envmap draws directions from
+        [[nodiscard]] static Distribution2D _build_envmap_distribution(const Image &envmap);
+
+        // Swaps in a finished background envmap load, called at frame boundaries
+        void _poll_envmap();
+
+        // Decides whether a path continues after `bounce`, dividing the throughput of survivors by
+        // their survival probability so the estimate stays unbiased
+        [[nodiscard]] bool _survives_roulette(int bounce, glm::vec3 &throughput) const;
+
+        // Adds the hit's emission and direct light, then scatters the ray and attenuates the
+        // throughput. scatter_pdf carries the solid angle pdf of the bounce that led here when
+        // that vertex already sampled the lights, 0 otherwise.
+        void _shade_hit(
+          const HitRecord &record,
+          Ray &            ray,
+          glm::vec3 &      throughput,
+          glm::vec3 &      radiance,
+          float &          scatter_pdf,
+          uint64_t &       rays);
+
+        // Collects every placed triangle with an emissive material in world space, weighted by
+        // area times emission
+        void _build_light_list();
+
+        // Light arriving at a diffuse hit from one sampled point on an emissive triangle,
+        // already multiplied by the BSDF and cosine and divided by the sample's pdf
+        [[nodiscard]] glm::vec3 _sample_lights(
+          const HitRecord &record,
+          const glm::vec3 &normal,
+          uint64_t &       rays);
+
+        // Like _sample_lights but for a direction importance sampled from the envmap, MIS weighted
+        // against the cosine lobe that also finds the envmap when its bounce escapes
+        [[nodiscard]] glm::vec3 _sample_envmap(
+          const HitRecord &record,
+          const glm::vec3 &normal,
+          uint64_t &       rays);
+
+        [[nodiscard]] bool _occluded(
+          const glm::vec3 &origin,
+          const glm::vec3 &direction,
+          float            distance);
+
+        GLFWwindow *_window = nullptr;
 
         RenderTargetSettings _render_target_setting;
         RayTracingContext    _ray_tracing_context;
@@ -78,18 +301,58 @@ namespace PT2
             int y;
         } _screen_resolution;
 
-        RTCScene    _scene;
-        RTCDevice   _device;
-        RTCGeometry _geometry;
+        RTCScene     _scene = nullptr;
+        RTCDevice    _device;
+        int          _packet_width      = 1;
+        BuildProfile _build_profile     = BuildProfile::BALANCED;
+        float        _tessellation_rate = 0.f;
+        bool         _scene_dirty       = false;    // _scene has uncommitted instances
+
+        // Bytes Embree currently has allocated, kept up to date by its memory monitor
+        std::atomic<int64_t> _device_bytes = 0;
+
+        // _device_bytes of an empty scene, the scene's BVHs are measured from here
+        int64_t _scene_bytes_base = 0;
 
         ThreadPool _render_pool;
+        uint32_t   _accumulated_spp     = 0;
+        uint32_t   _render_pass         = 0;
+        uint64_t   _samples_before_pass = 0;
+        uint64_t   _passes_started      = 0;
+        uint64_t   _passes_resolved     = 0;    // _passes_started at the last GUI resolve
+
+        // Tile indices (x + y * columns) in the order they get dispatched
+        std::vector<uint32_t> _tile_order;
+        TileOrder             _tile_order_type = TileOrder::SCANLINE;
+        uint32_t              _tile_columns    = 0;
+        uint32_t              _tile_rows       = 0;
+
+        RenderStats           _stats;
+        std::atomic<uint64_t> _ray_count    = 0;
+        std::atomic<uint64_t> _sample_count = 0;
 
         std::optional<Image> _envmap;
+        Distribution2D       _envmap_distribution;
+
+        std::future<std::optional<LoadedEnvmap>> _pending_envmap;
+        std::future<std::optional<LoadedModel>>  _pending_model;
+        glm::mat4                                _pending_transform = glm::mat4(1.f);
         std::vector<Material> _loaded_materials;
 
-        std::vector<uint8_t> _material_indices;
-        std::vector<glm::vec3> _vertices;
-        std::vector<uint32_t>  _indices;
+        std::vector<LoadedModel> _models;
+        std::vector<Instance>    _instances;
+
+        struct LightTriangle
+        {
+            glm::vec3 v0, v1, v2;
+            uint32_t  material;
+        };
+
+        std::vector<LightTriangle> _light_triangles;
+        Distribution1D             _light_distribution;
+
+        // Per _loaded_materials entry, whether _light_triangles covers its emission
+        std::vector<uint8_t> _sampled_lights;
     };
 }    // namespace PT2
 
@@ -22,8 +22,17 @@ SOFTWARE.
 
 #pragma once
 
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
 #include <glm/glm.hpp>
 
+inline float luminance(const glm::vec3 &color)
+{
+    return glm::dot(color, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
 inline glm::vec3 cos_sample_hemisphere(float x, float y)
 {
     const auto r = sqrtf(x);
@@ -34,3 +43,135 @@ inline glm::vec3 cos_sample_hemisphere(float x, float y)
 
     return { u, v, sqrtf(fmaxf(0.0f, 1.0f - x)) };
 }
+
+// Rotates a z-up direction into an orthonormal basis around normal (Duff et al. 2017)
+inline glm::vec3 to_world(const glm::vec3 &local, const glm::vec3 &normal)
+{
+    const auto sign = copysignf(1.0f, normal.z);
+    const auto a = -1.0f / (sign + normal.z);
+    const auto b = normal.x * normal.y * a;
+
+    const auto tangent =
+        glm::vec3(1.0f + sign * normal.x * normal.x * a, sign * b, -sign * normal.x);
+    const auto bitangent = glm::vec3(b, sign + normal.y * normal.y * a, -normal.y);
+    return tangent * local.x + bitangent * local.y + normal * local.z;
+}
+
+// Balances two sampling strategies by their pdfs (Veach's power heuristic, beta = 2)
+inline float power_heuristic(float pdf, float other_pdf)
+{
+    const auto a = pdf * pdf;
+    const auto b = other_pdf * other_pdf;
+    return a + b > 0.0f ? a / (a + b) : 0.0f;
+}
+
+// Equirectangular mapping used by the environment map, v = 0 is straight up (+y)
+inline glm::vec2 direction_to_uv(const glm::vec3 &direction)
+{
+    return { 0.5f + atan2f(direction.z, direction.x) / (2.0f * 3.1415f),
+             0.5f - asinf(fmaxf(-1.0f, fminf(1.0f, direction.y))) / 3.1415f };
+}
+
+inline glm::vec3 uv_to_direction(const glm::vec2 &uv)
+{
+    const auto phi = (uv.x - 0.5f) * 2.0f * 3.1415f;
+    const auto theta = uv.y * 3.1415f;
+    return { sinf(theta) * cosf(phi), cosf(theta), sinf(theta) * sinf(phi) };
+}
+
+// Uniformly distributed barycentrics (b1, b2) over a triangle
+inline glm::vec2 sample_triangle(float x, float y)
+{
+    const auto su = sqrtf(x);
+    return { 1.0f - su, y * su };
+}
+
+// Piecewise constant distribution over a list of weights, sampled by inverting its CDF
+struct Distribution1D
+{
+    Distribution1D() = default;
+
+    explicit Distribution1D(const std::vector<float> &weights) : cdf(weights.size() + 1, 0.0f)
+    {
+        for (size_t i = 0; i < weights.size(); i++) cdf[i + 1] = cdf[i] + weights[i];
+        total = cdf.back();
+    }
+
+    // Picks an index with a chance of weight / total, which is returned through probability
+    size_t sample(float u, float &probability) const
+    {
+        const auto upper = std::upper_bound(cdf.begin(), cdf.end(), u * total) - cdf.begin();
+        const auto last  = static_cast<std::ptrdiff_t>(cdf.size()) - 2;
+        const auto index = static_cast<size_t>(std::clamp<std::ptrdiff_t>(upper - 1, 0, last));
+        probability = (cdf[index + 1] - cdf[index]) / total;
+        return index;
+    }
+
+    // Continuous version over [0, 1), density is relative to that interval
+    float sample_continuous(float u, float &density) const
+    {
+        auto probability = 0.0f;
+        const auto index = sample(u, probability);
+        const auto offset = (u * total - cdf[index]) / (cdf[index + 1] - cdf[index]);
+        density = probability * count();
+        return (index + fminf(offset, 0.99999f)) / count();
+    }
+
+    [[nodiscard]] float density(float x) const
+    {
+        if (empty()) return 0.0f;
+        const auto index = std::min(static_cast<size_t>(x * count()), count() - 1);
+        return (cdf[index + 1] - cdf[index]) / total * count();
+    }
+
+    [[nodiscard]] size_t count() const { return cdf.size() - 1; }
+    [[nodiscard]] bool empty() const { return total <= 0.0f; }
+
+    std::vector<float> cdf;
+    float total = 0.0f;
+};
+
+// Distribution over the unit square from a width * height grid of weights: a marginal
+// distribution picks the row, then that row's conditional distribution picks the column
+struct Distribution2D
+{
+    Distribution2D() = default;
+
+    Distribution2D(const std::vector<float> &weights, size_t width, size_t height)
+    {
+        auto row_totals = std::vector<float>(height);
+        conditional.reserve(height);
+        for (size_t y = 0; y < height; y++)
+        {
+            const auto row = weights.begin() + y * width;
+            conditional.emplace_back(std::vector<float>(row, row + width));
+            row_totals[y] = conditional.back().total;
+        }
+        marginal = Distribution1D(row_totals);
+    }
+
+    // Returns a point in the unit square with its density
+    glm::vec2 sample(float x, float y, float &density) const
+    {
+        auto row_density = 0.0f;
+        auto column_density = 0.0f;
+        const auto v = marginal.sample_continuous(y, row_density);
+        const auto row = std::min(static_cast<size_t>(v * marginal.count()), marginal.count() - 1);
+        const auto u = conditional[row].sample_continuous(x, column_density);
+        density = row_density * column_density;
+        return { u, v };
+    }
+
+    [[nodiscard]] float density(const glm::vec2 &uv) const
+    {
+        if (empty()) return 0.0f;
+        const auto rows = marginal.count();
+        const auto row = std::min(static_cast<size_t>(uv.y * rows), rows - 1);
+        return marginal.density(uv.y) * conditional[row].density(uv.x);
+    }
+
+    [[nodiscard]] bool empty() const { return marginal.empty(); }
+
+    std::vector<Distribution1D> conditional;
+    Distribution1D marginal;
+};
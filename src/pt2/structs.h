@@ -6,6 +6,9 @@
 
 #include <cstdint>
 #include <cmath>
+#include <algorithm>
+#include <string>
+#include <vector>
 
 #include <glm/glm.hpp>
 
@@ -15,18 +18,100 @@ namespace PT2
     {
         uint16_t x;
         uint16_t y;
+        uint32_t pass;
+    };
+
+    struct TileBounds
+    {
+        uint64_t x_min;
+        uint64_t x_max;
+        uint64_t y_min;
+        uint64_t y_max;
+    };
+
+    enum class TileOrder
+    {
+        SCANLINE,
+        SPIRAL,     // Centre out, so the middle of the image converges first
+        HILBERT,    // Consecutive tiles are mostly neighbours, always on power of two grids
+    };
+
+    enum class RenderEngine
+    {
+        MEGAKERNEL,
+        WAVEFRONT,
+    };
+
+    // Embree build quality and scene flags, trading BVH build time and memory for trace speed
+    enum class BuildProfile
+    {
+        INTERACTIVE,    // Low quality dynamic scenes, fastest to (re)build
+        BALANCED,       // Embree's defaults
+        FINAL,          // High quality with spatial splits, slowest to build, fastest to trace
+        COMPACT,        // Compact BVH layout for memory constrained machines
+    };
+
+    struct RenderStats
+    {
+        double   load_ms     = 0.0;    // Model parsing and geometry upload
+        double   build_ms    = 0.0;    // Embree BVH build
+        uint64_t triangles   = 0;      // Unique triangles, each model's counted once
+        uint64_t quads       = 0;      // Unique quads, same as triangles
+        uint64_t points      = 0;      // Analytic spheres and discs
+        uint64_t instances   = 0;      // Placed copies of the models
+        int64_t  bvh_bytes   = 0;      // BVHs of the scene, geometry buffers are shared with us
+        int64_t  trace_bytes = 0;      // Allocated by Embree while tracing (tessellation cache)
+        double   trace_ms    = 0.0;    // All render passes
+        double   resolve_ms  = 0.0;    // Accumulation buffer -> RGBA8
+        uint64_t rays        = 0;
+        uint64_t samples     = 0;
+        uint64_t steals      = 0;      // Tiles stolen between render pool workers
+        double   idle_ms     = 0.0;    // Render pool worker idle time, summed over workers
     };
 
     struct Image
     {
-        uint64_t             width;
-        uint64_t             height;
-        std::vector<uint8_t> data;
+        uint64_t           width;
+        uint64_t           height;
+        std::vector<float> data;    // Linear RGB, 3 floats per texel
+
+        [[nodiscard]] glm::vec3 texel(uint64_t x, uint64_t y) const
+        {
+            const auto *rgb = &data[(x + y * width) * 3];
+            return glm::vec3(rgb[0], rgb[1], rgb[2]);
+        }
+
+        // Bilinearly filtered, wrapping around horizontally and clamped at the top and bottom
+        [[nodiscard]] glm::vec3 sample(float u, float v) const
+        {
+            const auto x  = u * width - 0.5f;
+            const auto y  = fminf(fmaxf(v * height - 0.5f, 0.f), height - 1.f);
+            const auto x0 = floorf(x);
+            const auto y0 = floorf(y);
+            const auto fx = x - x0;
+            const auto fy = y - y0;
+
+            const auto columns = static_cast<int64_t>(width);
+            const auto wrap    = [&](int64_t column) {
+                return static_cast<uint64_t>((column % columns + columns) % columns);
+            };
+            const auto left   = wrap(static_cast<int64_t>(x0));
+            const auto right  = wrap(static_cast<int64_t>(x0) + 1);
+            const auto top    = static_cast<uint64_t>(y0);
+            const auto bottom = std::min(top + 1, height - 1);
+
+            return glm::mix(
+              glm::mix(texel(left, top), texel(right, top), fx),
+              glm::mix(texel(left, bottom), texel(right, bottom), fx),
+              fy);
+        }
     };
 
     struct Ray
     {
     public:
+        Ray() = default;
+
         Ray(const glm::vec3 &origin, const glm::vec3 &direction)
             : origin(origin), direction(direction)
         {
@@ -58,6 +143,46 @@ namespace PT2
         std::string name;
     };
 
+    // CPU side copy of a loaded model, everything the renderer needs next to the Embree scene
+    // Embree is handed vertices and indices without a copy and reads their last element with a 16
+    // byte load. Loaders size them with resize_padded, so that load stays inside the allocation.
+    struct Mesh
+    {
+        std::vector<glm::vec3> vertices;
+        std::vector<uint32_t>  indices;          // Three per triangle, grouped by shape
+        std::vector<uint32_t>  quad_indices;     // Four per quad, grouped by shape
+        std::vector<uint32_t>  shape_offsets;    // First triangle of each shape, plus the end
+        std::vector<uint32_t>  quad_offsets;     // First quad of each shape, plus the end
+        std::vector<Material>  materials;        // One per shape
+
+        [[nodiscard]] size_t shape_count() const noexcept
+        {
+            return shape_offsets.empty() ? 0 : shape_offsets.size() - 1;
+        }
+    };
+
+    enum class PointShape
+    {
+        SPHERE,
+        DISC,    // Always facing the ray
+    };
+
+    // Analytic primitives sharing one material, traced as they are instead of tessellated
+    struct PointSet
+    {
+        PointShape             shape = PointShape::SPHERE;
+        std::vector<glm::vec4> points;    // Center in xyz, radius in w
+        Material               material;
+    };
+
+    // Resizes array to count elements with room for one more
+    template<typename T>
+    void resize_padded(std::vector<T> &array, size_t count)
+    {
+        array.reserve(count + 1);
+        array.resize(count);
+    }
+
     struct RenderTargetSettings
     {
         float x_offset = 0.f;
@@ -122,8 +247,23 @@ namespace PT2
 
     struct RayTracingContext
     {
-        int bounces = 4;
-        int spp     = 1;
+        int      bounces            = 4;
+        int      spp                = 1;          // Samples added to every pixel per pass
+        int      max_spp            = 0;          // Passes stop here, 0 = no limit (adaptive: 4096)
+        bool     progressive        = true;
+        uint32_t seed               = 0;          // Mixed into every tile's random sequence
+        bool     packet_primary     = true;       // Trace camera rays as 8 / 16 wide packets
+        int      wavefront_size     = 1 << 14;    // Paths in flight per thread (wavefront engine)
+        bool     sort_by_material   = true;       // Shade wavefront hits grouped by material
+        bool     next_event         = true;       // Sample emissive triangles at diffuse hits
+        bool     russian_roulette   = true;       // End dim paths early, reweighting survivors
+        int      rr_min_depth       = 3;          // Bounces before roulette may end a path
+        bool     adaptive           = false;      // Stop sampling pixels once they look converged
+        int      min_spp            = 16;         // Samples every pixel gets before it may stop
+        float    adaptive_threshold = 0.02f;      // Relative error a pixel has to get below
+
+        RenderEngine engine     = RenderEngine::MEGAKERNEL;
+        TileOrder    tile_order = TileOrder::SPIRAL;
         struct
         {
             int x = 512;
@@ -135,7 +275,10 @@ namespace PT2
             int x_size = 512 / 8;
             int y_size = 512 / 8;
         } tiles;
-        std::vector<uint32_t> buffer;
+        std::vector<uint32_t>  buffer;               // Resolved RGBA8 image for display / export
+        std::vector<glm::vec3> accumulation;         // Running sum of radiance per pixel
+        std::vector<float>     luminance_squared;    // Sum of squared sample luminance per pixel
+        std::vector<uint32_t>  sample_count;         // Samples accumulated per pixel
 
         Camera camera = Camera(glm::vec3(-15, 12, 8), glm::vec3(0, 0, 0), 90, 1);
     };
@@ -1,35 +1,57 @@
 #include <iostream>
+#include <chrono>
+#include <algorithm>
 #include "thread_pool.h"
 
-ThreadPool::ThreadPool(uint8_t thread_count) : _thread_count(thread_count), _should_work(true)
+namespace
 {
-    for (auto i = 0; i < thread_count; i++) _threads.emplace_back([this]() { _thread_wait(); });
+    void run_function(void *function, uint32_t, uint32_t)
+    {
+        (*static_cast<std::function<void()> *>(function))();
+    }
+}    // namespace
+
+ThreadPool::ThreadPool(uint32_t thread_count)
+    : _thread_count(std::max(1u, thread_count)), _should_work(true)
+{
+    for (uint32_t i = 0; i < _thread_count; i++)
+        _queues.push_back(std::make_unique<WorkerQueue>());
+    for (uint32_t i = 0; i < _thread_count; i++)
+        _threads.emplace_back([this, i]() { _thread_wait(i); });
 }
 
 ThreadPool::~ThreadPool()
 {
     _should_work = false;
     {
-        std::lock_guard lock(_work_mutex);
+        std::lock_guard lock(_sleep_mutex);
         _work_condition_variable.notify_all();
     }
-    for (auto &thread : _threads) thread.join();
+    for (auto &thread : _threads)
+        if (thread.joinable()) thread.join();
 }
 
-void ThreadPool::_thread_wait()
+void ThreadPool::_thread_wait(uint32_t worker)
 {
     while (_should_work)
     {
+        auto task = _get_task(worker);
+        while (task.has_value())
         {
-            std::unique_lock lock(_work_mutex);
-            _work_condition_variable.wait(lock);
+            task->function(task->context, task->begin, task->end);
+            _finish_task();
+            task = _get_task(worker);
         }
-        auto task = _get_task();
-        while (task.has_value())
+
+        const auto idle_start = std::chrono::steady_clock::now();
         {
-            task.value()();
-            task = _get_task();
+            std::unique_lock lock(_sleep_mutex);
+            _work_condition_variable.wait(
+              lock,
+              [this] { return !_should_work || _queued_tasks > 0; });
         }
+        const auto idle_time = std::chrono::steady_clock::now() - idle_start;
+        _idle_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(idle_time).count();
     }
 }
 
@@ -38,44 +60,150 @@ void ThreadPool::start()
     _threads.clear();
     _threads.shrink_to_fit();
     _should_work = true;
-    for (auto i = 0; i < _thread_count; i++) _threads.emplace_back([this]() { _thread_wait(); });
+    for (uint32_t i = 0; i < _thread_count; i++)
+        _threads.emplace_back([this, i]() { _thread_wait(i); });
 }
 
 void ThreadPool::stop()
 {
     _should_work = false;
+    clear_tasks();
     {
-        std::lock_guard lock(_task_mutex);
-        while (!_tasks.empty()) _tasks.pop();
-    }
-    {
-        std::lock_guard lock(_work_mutex);
+        std::lock_guard lock(_sleep_mutex);
         _work_condition_variable.notify_all();
     }
     for (auto &thread : _threads) thread.join();
 }
 
+void ThreadPool::parallel_for(
+  uint32_t      begin,
+  uint32_t      end,
+  uint32_t      grain,
+  RangeFunction function,
+  void *        context)
+{
+    if (begin >= end) return;
+    grain = std::max(grain, 1u);
+
+    const auto chunks = (end - begin + grain - 1) / grain;
+    _pending_tasks += chunks;
+    for (auto chunk = 0u; chunk < chunks; chunk++)
+    {
+        const auto chunk_begin = begin + chunk * grain;
+        _push_task({ function, context, chunk_begin, std::min(chunk_begin + grain, end) });
+    }
+
+    std::lock_guard lock(_sleep_mutex);
+    _work_condition_variable.notify_all();
+}
+
 void ThreadPool::add_tasks(const std::vector<std::function<void()>> &tasks)
 {
-    std::unique_lock lock(_task_mutex);
-    for (const auto &task : tasks) _tasks.push(task);
+    if (tasks.empty()) return;
+
+    // Only this (submitting) thread touches _functions, and nothing can reference them once
+    // every earlier task has finished
+    if (_pending_tasks == 0) _functions.clear();
+
+    _pending_tasks += tasks.size();
+    for (const auto &task : tasks)
+    {
+        auto *function = &_functions.emplace_back(task);
+        _push_task({ run_function, function, 0, 1 });
+    }
+
+    std::lock_guard lock(_sleep_mutex);
     _work_condition_variable.notify_all();
 }
 
+void ThreadPool::_push_task(const Task &task)
+{
+    auto &          queue = *_queues[_next_queue++ % _thread_count];
+    std::lock_guard lock(queue.mutex);
+    queue.tasks.push_back(task);
+    _queued_tasks++;
+}
+
 void ThreadPool::clear_tasks()
 {
-    std::unique_lock lock(_task_mutex);
-    while (!_tasks.empty()) _tasks.pop();
+    for (auto &queue : _queues)
+    {
+        std::lock_guard lock(queue->mutex);
+        const auto      count = queue->tasks.size() - queue->head;
+        _queued_tasks -= count;
+        _pending_tasks -= count;
+        queue->tasks.clear();
+        queue->head = 0;
+    }
+
+    std::lock_guard lock(_sleep_mutex);
+    if (_pending_tasks == 0) _idle_condition_variable.notify_all();
+}
+
+void ThreadPool::wait()
+{
+    std::unique_lock lock(_sleep_mutex);
+    _idle_condition_variable.wait(lock, [this] { return _pending_tasks == 0; });
+}
+
+bool ThreadPool::idle() const { return _pending_tasks == 0; }
+
+ThreadPoolStats ThreadPool::stats() const
+{
+    auto stats    = ThreadPoolStats();
+    stats.tasks   = _tasks_run;
+    stats.steals  = _steals;
+    stats.idle_ms = _idle_ns / 1e6;
+    return stats;
 }
 
-std::optional<std::function<void()>> ThreadPool::_get_task()
+void ThreadPool::_finish_task()
 {
-    std::unique_lock lock(_task_mutex);
-    if (!_tasks.empty())
+    _tasks_run++;
+    if (_pending_tasks.fetch_sub(1) == 1)
     {
-        const auto ret = _tasks.front();
-        _tasks.pop();
-        return ret;
+        std::lock_guard lock(_sleep_mutex);
+        _idle_condition_variable.notify_all();
+    }
+}
+
+std::optional<ThreadPool::Task> ThreadPool::_get_task(uint32_t worker)
+{
+    // Own queue first, oldest task first
+    {
+        auto &          queue = *_queues[worker];
+        std::lock_guard lock(queue.mutex);
+        if (queue.head < queue.tasks.size())
+        {
+            const auto task = queue.tasks[queue.head++];
+            if (queue.head == queue.tasks.size())
+            {
+                queue.tasks.clear();
+                queue.head = 0;
+            }
+            _queued_tasks--;
+            return task;
+        }
+    }
+
+    // Then steal the newest task of the next worker that has any
+    for (uint32_t offset = 1; offset < _thread_count; offset++)
+    {
+        auto &          victim = *_queues[(worker + offset) % _thread_count];
+        std::lock_guard lock(victim.mutex);
+        if (victim.head < victim.tasks.size())
+        {
+            const auto task = victim.tasks.back();
+            victim.tasks.pop_back();
+            if (victim.head == victim.tasks.size())
+            {
+                victim.tasks.clear();
+                victim.head = 0;
+            }
+            _queued_tasks--;
+            _steals++;
+            return task;
+        }
     }
 
     return {};
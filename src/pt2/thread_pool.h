@@ -6,38 +6,103 @@
 #include <thread>
 #include <vector>
 #include <functional>
-#include <queue>
+#include <deque>
+#include <memory>
 #include <atomic>
+#include <optional>
 
 #include <pt2/structs.h>
 
+struct ThreadPoolStats
+{
+    uint64_t tasks   = 0;      // Tasks run to completion
+    uint64_t steals  = 0;      // Tasks taken from another worker's queue
+    double   idle_ms = 0.0;    // Summed over all workers
+};
+
+// Work stealing pool, every worker owns a deque of tasks. Owners take from the front of their own
+// deque, so tasks run roughly in the order they were added, and idle workers steal from the back
+// of somebody else's.
 class ThreadPool
 {
 public:
-    explicit ThreadPool(uint8_t thread_count);
+    using RangeFunction = void (*)(void *context, uint32_t begin, uint32_t end);
+
+    // At least one worker is started, whatever thread_count says
+    explicit ThreadPool(uint32_t thread_count);
 
     ~ThreadPool();
 
+    // Splits [begin, end) into chunks of at most grain indices and calls function once per chunk.
+    // Nothing is copied or allocated per chunk, so context has to stay alive until the work is
+    // done (see wait()).
+    void parallel_for(
+      uint32_t      begin,
+      uint32_t      end,
+      uint32_t      grain,
+      RangeFunction function,
+      void *        context);
+
+    // Tasks are dealt round robin over the worker deques
     void add_tasks(const std::vector<std::function<void()>> &tasks);
 
     void clear_tasks();
 
+    // Blocks until every queued task has been picked up and finished
+    void wait();
+
+    [[nodiscard]] bool idle() const;
+
+    [[nodiscard]] uint32_t thread_count() const noexcept { return _thread_count; }
+
+    [[nodiscard]] ThreadPoolStats stats() const;
+
     void start();
 
     void stop();
 
 private:
-    void _thread_wait();
+    struct Task
+    {
+        RangeFunction function;
+        void *        context;
+        uint32_t      begin;
+        uint32_t      end;
+    };
+
+    // A deque that keeps its storage between batches, front is `head`, back is the vector's back
+    struct WorkerQueue
+    {
+        std::mutex        mutex;
+        std::vector<Task> tasks;
+        size_t            head = 0;
+    };
+
+    void _thread_wait(uint32_t worker);
+
+    void _push_task(const Task &task);
 
-    [[nodiscard]] std::optional<std::function<void()>> _get_task();
+    void _finish_task();
 
-    uint16_t _thread_count;
-    std::mutex              _work_mutex;
+    [[nodiscard]] std::optional<Task> _get_task(uint32_t worker);
+
+    uint32_t                _thread_count;
     std::atomic<bool>       _should_work;
+    std::mutex              _sleep_mutex;
     std::condition_variable _work_condition_variable;
+    std::condition_variable _idle_condition_variable;
+
+    std::vector<std::unique_ptr<WorkerQueue>> _queues;
+    std::atomic<uint32_t>                     _queued_tasks  = 0;    // Sitting in a deque
+    std::atomic<uint32_t>                     _pending_tasks = 0;    // Queued or running
+    std::atomic<uint32_t>                     _next_queue    = 0;
+
+    // Owns the callables handed to add_tasks until the pool runs dry
+    std::deque<std::function<void()>> _functions;
 
-    std::mutex                        _task_mutex;
-    std::queue<std::function<void()>> _tasks;
+    std::atomic<uint64_t> _tasks_run = 0;
+    std::atomic<uint64_t> _steals    = 0;
+    std::atomic<uint64_t> _idle_ns   = 0;
 
     std::vector<std::thread> _threads;
 };